@@ -2,15 +2,33 @@
     'variables': {
         'include_files': [
             'include/image/image.hpp',
+            'include/image/bitmap_pool.hpp',
+            'include/image/convert.hpp',
             'include/image/encoder.hpp',
+            'include/image/frame_diff.hpp',
+            'include/image/frame_publisher.hpp',
+            'include/image/memory.hpp',
+            'include/image/output_device.hpp',
             'include/image/quantizer.hpp',
+            'include/image/raw_file.hpp',
             'include/image/rescaler.hpp',
+            'include/image/shared_memory.hpp',
+            'include/image/test_source.hpp',
         ],
         'source_files': [
             'src/image.cpp',
+            'src/bitmap_pool.cpp',
+            'src/convert.cpp',
             'src/encoder.cpp',
+            'src/frame_diff.cpp',
+            'src/frame_publisher.cpp',
+            'src/frame_ring.cpp',
+            'src/latency_histogram.cpp',
+            'src/memory.cpp',
+            'src/output_device.cpp',
             'src/quantizer.cpp',
             'src/rescaler.cpp',
+            'src/test_source.cpp',
         ],
     },
     'targets': [
@@ -30,6 +48,11 @@
             },
             'defines': ['IMAGE_EXPORTS'],
             'sources': ['<@(include_files)', '<@(source_files)'],
+            'conditions': [
+                ['OS!="win"', {
+                    'sources': ['src/raw_file.cpp', 'src/shared_memory.cpp'],
+                }],
+            ],
         },
     ],
 }
\ No newline at end of file
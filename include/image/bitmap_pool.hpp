@@ -0,0 +1,68 @@
+#ifndef IMAGE_BITMAP_POOL_HPP_INCLUDED
+#define IMAGE_BITMAP_POOL_HPP_INCLUDED
+
+#include "image/image.hpp"
+#include "image/memory.hpp"
+
+namespace aspect { namespace image {
+
+/// Thread-safe pool of bitmaps with the same size and pixel format.
+/// Bitmaps acquired from the pool return to it when the last shared_bitmap
+/// reference is released, instead of freeing their memory. The pool may be
+/// destroyed before the bitmaps acquired from it.
+class IMAGE_API bitmap_pool : boost::noncopyable
+{
+public:
+	/// Pool usage statistics
+	struct stats
+	{
+		size_t hits;         ///< acquired bitmaps reused from the pool
+		size_t misses;       ///< acquired bitmaps allocated anew
+		size_t in_use;       ///< acquired bitmaps not returned yet
+		size_t free_count;   ///< bitmaps kept in the pool for reuse
+		size_t free_bytes;   ///< memory of the kept bitmaps
+		size_t dropped;      ///< returned bitmaps freed due to the pool limits, or resized while in use
+		memory_usage memory; ///< memory of the bitmaps owned by the pool, in use and free
+	};
+
+	/// Create a pool keeping at most max_free_per_key bitmaps of each
+	/// size and format, and at most max_free_bytes of all free bitmaps,
+	/// 0 for no limit. New bitmaps are allocated with alloc option and
+	/// rows aligned to row_alignment bytes.
+	explicit bitmap_pool(size_t max_free_per_key = 8, size_t max_free_bytes = 0,
+		allocation alloc = ALLOC_UNINITIALIZED, size_t row_alignment = 1);
+	~bitmap_pool();
+
+	/// Get a bitmap with the size and pixel format. Pixel data of a reused
+	/// bitmap is not cleared.
+	shared_bitmap acquire(image_size const& size, encoding pixel_format = BGRA8);
+
+	/// Change pool limits, free bitmaps over the limits are released
+	void set_limits(size_t max_free_per_key, size_t max_free_bytes);
+
+	size_t max_free_per_key() const;
+	size_t max_free_bytes() const;
+
+	/// Allocation option for new bitmaps
+	allocation get_allocation() const;
+
+	/// Row alignment of new bitmaps
+	size_t row_alignment() const;
+
+	/// Release free bitmaps until at most max_free_bytes are kept, oldest first
+	void trim(size_t max_free_bytes = 0);
+
+	/// Set pool name in memory::get_info() counters
+	void set_name(std::string const& name);
+
+	/// Current pool statistics
+	stats get_stats() const;
+
+private:
+	class impl;
+	boost::shared_ptr<impl> impl_;
+};
+
+}} // aspect::image
+
+#endif // IMAGE_BITMAP_POOL_HPP_INCLUDED
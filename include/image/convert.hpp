@@ -0,0 +1,73 @@
+#ifndef IMAGE_CONVERT_HPP_INCLUDED
+#define IMAGE_CONVERT_HPP_INCLUDED
+
+#include "image/image.hpp"
+
+// Pixel format conversion
+//
+// Formats interpretation:
+//   YUV8   - packed 4:2:2 8-bit, UYVY byte order
+//   YUV10  - packed 4:2:2 10-bit, v210
+//   RGB10  - packed 10-bit RGB, big-endian r210
+//   A8     - alpha only; converted to color as a grey matte
+//   RGB32F - not supported
+//   I420, NV12, P010 - planar 4:2:0, converted through UYVY rows with 8-bit
+//            precision, only with the bitmap overload of convert()
+// Conversions without a direct kernel go through a BGRA8 row, so 10-bit
+// formats are converted with 8-bit precision.
+
+namespace aspect { namespace image {
+
+/// YUV color space for conversion
+enum yuv_colorspace
+{
+	BT601,
+	BT709,
+};
+
+/// SIMD instruction set used by convert()
+enum simd_level
+{
+	SIMD_NONE,
+	SIMD_SSSE3,
+	SIMD_AVX2,
+	SIMD_NEON,
+};
+
+struct convert_options
+{
+	yuv_colorspace colorspace; ///< YUV color space, BT709 by default
+	uint8_t alpha;             ///< alpha value for sources without alpha, stored inverted: 0 opaque by default
+	size_t max_threads;        ///< threads for large images, 0 for all cores
+	simd_level max_simd;       ///< limit SIMD instruction set, e.g. for testing, see convert_simd_level()
+
+	convert_options()
+		: colorspace(BT709)
+		, alpha(0)
+		, max_threads(0)
+		, max_simd(SIMD_AVX2)
+	{
+	}
+};
+
+/// Is conversion between pixel formats supported
+IMAGE_API bool can_convert(encoding from, encoding to);
+
+/// Best SIMD instruction set available on this CPU
+IMAGE_API simd_level convert_simd_level();
+
+/// Best SIMD instruction set available limited to max_simd. x86 levels
+/// are ordered, on ARM any limit but SIMD_NONE allows NEON.
+IMAGE_API simd_level convert_simd_level(simd_level max_simd);
+
+/// Convert pixels of size with src_stride and dst_stride row sizes in bytes
+IMAGE_API bool convert(uint8_t const* src, size_t src_stride, encoding src_format,
+	uint8_t* dst, size_t dst_stride, encoding dst_format, image_size const& size,
+	convert_options const& options = convert_options());
+
+/// Convert src bitmap into dst pixel format, dst is resized to src size
+IMAGE_API bool convert(bitmap const& src, bitmap& dst, convert_options const& options = convert_options());
+
+}} // aspect::image
+
+#endif // IMAGE_CONVERT_HPP_INCLUDED
@@ -7,11 +7,12 @@
 namespace aspect { namespace image {
 
 class bitmap;
+class quantizer;
 
 class IMAGE_API png_color_type
 {
 public:
-	enum value_type { palette, rgb, rgba };
+	enum value_type { palette, rgb, rgba, palette_rgba };
 
 	png_color_type(value_type value) : value_(value) {}
 	operator value_type() const { return value_; }
@@ -32,7 +33,21 @@ inline std::string generate_png(bitmap const& image, buffer& result,
 		flip, compression, color_type);
 }
 
-/// Compresses bitmap image rect into JPEG and place in result buffer, return MIME type
+/// Compresses bitmap image rect into palette PNG with the quantizer settings
+/// and place in result buffer, return MIME type
+IMAGE_API std::string generate_png(bitmap const& image, buffer& result, image_rect rect,
+	quantizer& quantizer, bool flip = false, int compression = -1);
+
+inline std::string generate_png(bitmap const& image, buffer& result, quantizer& quantizer,
+	bool flip = false, int compression = -1)
+{
+	return generate_png(image, result, image_rect(0, 0, image.size().width, image.size().height),
+		quantizer, flip, compression);
+}
+
+/// Compresses bitmap image rect into JPEG and place in result buffer, return MIME type.
+/// Planar I420, NV12 and P010 images are compressed as 4:2:0 without color conversion,
+/// their samples are expanded from video to full range and decoded as BT.601.
 IMAGE_API std::string generate_jpeg(bitmap const& image, buffer& result, image_rect rect, bool flip = false, int quality = 90);
 
 inline std::string generate_jpeg(bitmap const& image, buffer& result, bool flip = false, int quality = 90)
@@ -0,0 +1,81 @@
+#ifndef IMAGE_FRAME_DIFF_HPP_INCLUDED
+#define IMAGE_FRAME_DIFF_HPP_INCLUDED
+
+#include "image/image.hpp"
+#include "image/convert.hpp"
+
+#include <vector>
+
+namespace aspect { namespace image {
+
+/// Detection of changed areas between consecutive frames, e.g. to skip
+/// rescaling and encoding of unchanged screen capture content.
+///
+/// Frames are compared in square tiles to a reference copy of the previous
+/// frame. Only dirty tiles are copied into the reference, so the cost per
+/// frame is a compare pass plus copying of the changed area. All planes
+/// are compared for planar formats. YUV10 frames are always entirely dirty.
+class IMAGE_API frame_diff : boost::noncopyable
+{
+public:
+	/// Tile size in pixels, a multiple of 16 in [16..256]
+	explicit frame_diff(int tile_size = 64, simd_level max_simd = SIMD_AVX2);
+
+	/// Compare frame to the previous one and make it the reference for the
+	/// next call. Dirty is filled with rectangles of changed tiles, adjacent
+	/// tiles are coalesced, clipped to the frame size. The whole frame is
+	/// dirty on the first call, after reset(), and on size or pixel format
+	/// change. Returns true if anything has changed.
+	bool update(bitmap const& frame, std::vector<image_rect>& dirty);
+
+	/// Forget the reference frame
+	void reset();
+
+	int tile_size() const { return tile_size_; }
+
+	/// Tiles in the last updated frame
+	size_t tile_count() const { return tiles_.size(); }
+
+	/// Changed tiles in the last updated frame
+	size_t dirty_tile_count() const { return dirty_tile_count_; }
+
+	/// Is tile at column and row changed in the last updated frame
+	bool is_dirty(size_t column, size_t row) const
+	{
+		return column < columns_ && row * columns_ + column < tiles_.size() && tiles_[row * columns_ + column] != 0;
+	}
+
+private:
+	typedef bool (*equal_fn)(uint8_t const* a, uint8_t const* b, size_t size);
+
+	struct plane_tiles
+	{
+		uint8_t const* src;
+		uint8_t* ref;
+		size_t src_stride;
+		size_t ref_stride;
+		size_t rows;
+		size_t row_bytes;
+		size_t tile_bytes;  // tile width in bytes
+		int shift_y;        // vertical subsampling
+	};
+
+	size_t get_planes(bitmap const& frame, plane_tiles (&planes)[bitmap::max_planes]);
+	void compare_band(plane_tiles const* planes, size_t plane_count, size_t band);
+	void copy_band(plane_tiles const* planes, size_t plane_count, size_t band, bool all);
+	void coalesce(image_size const& size, std::vector<image_rect>& dirty) const;
+
+	int tile_size_;
+	equal_fn equal_;
+
+	bitmap reference_;
+	bool has_reference_;
+
+	size_t columns_;
+	std::vector<uint8_t> tiles_; // dirty flags, row-major
+	size_t dirty_tile_count_;
+};
+
+}} // aspect::image
+
+#endif // IMAGE_FRAME_DIFF_HPP_INCLUDED
@@ -0,0 +1,66 @@
+#ifndef IMAGE_FRAME_PUBLISHER_HPP_INCLUDED
+#define IMAGE_FRAME_PUBLISHER_HPP_INCLUDED
+
+#include "image/image.hpp"
+#include "image/bitmap_pool.hpp"
+
+#include <atomic>
+
+namespace aspect { namespace image {
+
+/// Latest frame publication from one writer to many readers without
+/// bitmap locks.
+///
+/// The writer fills bitmaps of a back buffer and publishes it, the
+/// published frame must not be changed after that. Readers take a snapshot
+/// of the latest published frame and may use it as long as they need,
+/// without locking bitmap::shared_mutex(). Back buffer bitmaps are reused
+/// only after the last snapshot referencing them has been released, so
+/// readers never block the writer and the writer never changes pixels a
+/// reader sees.
+class IMAGE_API frame_publisher : boost::noncopyable
+{
+public:
+	/// Create a publisher with back buffers allocated with alloc option and
+	/// rows aligned to row_alignment bytes
+	explicit frame_publisher(allocation alloc = ALLOC_UNINITIALIZED, size_t row_alignment = 1);
+	~frame_publisher();
+
+	/// Writer: get a frame to fill with a color bitmap of size and color_format
+	/// and with a separate alpha bitmap when alpha_format is not UNKNOWN.
+	/// Bitmaps are not referenced by any reader, pixel data is not cleared.
+	shared_bitmap_container back_buffer(image_size const& size, encoding color_format,
+		encoding alpha_format = UNKNOWN, uint32_t flags = shared_bitmap_container::LOCAL);
+
+	/// Writer: publish a filled frame, it replaces the previously published one
+	void publish(shared_bitmap_container const& frame);
+
+	/// Writer: withdraw the published frame, e.g. on stopping capture
+	void clear();
+
+	/// Reader: get the latest published frame and its generation,
+	/// returns false if no frame is published
+	bool snapshot(shared_bitmap_container& frame, uint64_t* generation = nullptr) const;
+
+	/// Number of frames published so far, readers can poll it to find
+	/// whether a new frame is available without taking a snapshot
+	uint64_t generation() const { return generation_.load(std::memory_order_acquire); }
+
+	/// Back buffer pool statistics
+	bitmap_pool::stats get_stats() const { return pool_.get_stats(); }
+
+private:
+	struct published
+	{
+		shared_bitmap_container frame;
+		uint64_t generation;
+	};
+
+	bitmap_pool pool_;
+	boost::shared_ptr<published const> published_; // accessed with boost::atomic_load/store
+	std::atomic<uint64_t> generation_;
+};
+
+}} // aspect::image
+
+#endif // IMAGE_FRAME_PUBLISHER_HPP_INCLUDED
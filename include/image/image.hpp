@@ -9,6 +9,15 @@
 
 #include <boost/thread/shared_mutex.hpp>
 
+#if !OS(LINUX)
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#endif
+
+#include <atomic>
+#include <chrono>
+#include <vector>
+
 #if OS(WINDOWS)
 //	#pragma warning ( disable : 4251 )
 #if defined(IMAGE_EXPORTS)
@@ -36,44 +45,76 @@ enum encoding
 	BGRA8,
 	RGB8,
 	RGB10,
-	RGB32F
+	RGB32F,
+	I420,   ///< planar 4:2:0 8-bit: Y, U, V planes
+	NV12,   ///< semi-planar 4:2:0 8-bit: Y plane, interleaved UV plane
+	P010,   ///< semi-planar 4:2:0 10-bit in 16-bit little-endian samples, high bits used
+};
+
+/// Plane of bitmap pixel data
+struct plane_layout
+{
+	size_t offset;    ///< offset in bitmap data
+	size_t stride;    ///< row size in bytes
+	image_size size;  ///< size in samples, chroma planes are subsampled
+};
+
+/// Bitmap pixel data allocation
+enum allocation
+{
+	ALLOC_ZEROED,        ///< heap memory, new pixel data is filled with zeros
+	ALLOC_UNINITIALIZED, ///< heap memory, new pixel data content is undefined
+	ALLOC_HUGE_PAGES,    ///< memory mapped with huge pages when available, heap otherwise
+};
+
+/// Pixel data storage owned outside of bitmap, e.g. shared memory
+class IMAGE_API bitmap_storage : boost::noncopyable
+{
+public:
+	virtual ~bitmap_storage() {}
 };
 
 /// Bitmap image with specified size and pixel format
 class IMAGE_API bitmap : boost::noncopyable
 {
 public:
-	explicit bitmap()
+	explicit bitmap(allocation alloc = ALLOC_ZEROED, size_t row_alignment = 1)
 		: pixel_format_(UNKNOWN)
+		, allocation_(alloc)
+		, row_alignment_(row_alignment)
+		, data_(nullptr)
+		, data_size_(0)
+		, capacity_(0)
+		, mapped_(false)
+		, plane_count_(0)
 	{
 	}
 
-	/// Create a bitmap with specified size and pixel format
-	bitmap(image_size const& size, encoding pixel_format = BGRA8)
+	/// Create a bitmap with specified size and pixel format, rows start at
+	/// row_alignment bytes boundary, a power of 2
+	bitmap(image_size const& size, encoding pixel_format = BGRA8, allocation alloc = ALLOC_ZEROED, size_t row_alignment = 1)
+		: pixel_format_(UNKNOWN)
+		, allocation_(alloc)
+		, row_alignment_(row_alignment)
+		, data_(nullptr)
+		, data_size_(0)
+		, capacity_(0)
+		, mapped_(false)
+		, plane_count_(0)
 	{
 		resize(size, pixel_format);
 	}
 
-	~bitmap()
-	{
-		total_memory_ -= data_.size();
-	}
+	/// Create a bitmap over pixel data in external storage, which is kept
+	/// alive while the bitmap uses it. Resizing over data_size reallocates
+	/// pixel data on heap.
+	bitmap(image_size const& size, encoding pixel_format, uint8_t* data, size_t data_size,
+		boost::shared_ptr<bitmap_storage> const& storage, size_t row_alignment = 1);
 
-	/// Resize bitmap and change pixel format
-	void resize(image_size const& size, encoding pixel_format)
-	{
-		boost::unique_lock<boost::shared_mutex> lock(shared_mutex_);
+	~bitmap();
 
-		if (size != size_ || pixel_format_ == pixel_format)
-		{
-			total_memory_ -= data_.size();
-			data_.resize(size.width * size.height * bytes_per_pixel(pixel_format), 0);
-			total_memory_ += data_.size();
-
-			size_ = size;
-			pixel_format_ = pixel_format;
-		}
-	}
+	/// Resize bitmap and change pixel format
+	void resize(image_size const& size, encoding pixel_format);
 
 	/// Resize bitmap
 	void resize(image_size const& size)
@@ -85,6 +126,7 @@ public:
 	encoding pixel_format() const { return pixel_format_; }
 	size_t bytes_per_pixel() const { return bytes_per_pixel(pixel_format_); }
 
+	/// Bytes per pixel, of the luma plane for planar formats
 	static size_t bytes_per_pixel(encoding pixel_format)
 	{
 		switch (pixel_format)
@@ -92,17 +134,68 @@ public:
 			case YUV8: return 2;
 			case A8:   return 1;
 			case RGB8: return 3;
+			case I420: return 1;
+			case NV12: return 1;
+			case P010: return 2;
 			default:   return 4; // all other formats use 4 bytes per pixel
 		}
 	}
 
+	/// Row size in bytes without padding, of the luma plane for planar formats
 	size_t row_bytes() const { return size_.width * bytes_per_pixel(); }
 
-	uint8_t const* data() const { return data_.empty()? nullptr : &data_[0]; }
-	uint8_t* data() { return data_.empty()? nullptr : &data_[0]; }
+	/// Distance between rows in bytes, of the luma plane for planar formats
+	size_t stride() const { return plane_count_? planes_[0].stride : row_bytes(); }
+
+	/// Row alignment in bytes
+	size_t row_alignment() const { return row_alignment_; }
+
+	/// Change row alignment, a power of 2; pixel data is reallocated and its content is undefined.
+	/// Returns false and keeps the alignment for pixel data in external storage.
+	bool set_row_alignment(size_t row_alignment);
+
+	static size_t const max_planes = 3;
+
+	/// Number of planes in the pixel format
+	static size_t plane_count(encoding pixel_format)
+	{
+		switch (pixel_format)
+		{
+			case I420: return 3;
+			case NV12: return 2;
+			case P010: return 2;
+			default:   return 1;
+		}
+	}
+
+	/// Get layout of planes for size and pixel format with rows aligned
+	/// to row_alignment bytes, returns total data size
+	static size_t get_layout(image_size const& size, encoding pixel_format, plane_layout (&planes)[max_planes],
+		size_t row_alignment = 1);
+
+	bool is_planar() const { return plane_count_ > 1; }
+	size_t plane_count() const { return plane_count_; }
+	plane_layout const& plane(size_t index) const { _aspect_assert(index < plane_count_); return planes_[index]; }
+
+	uint8_t const* plane_data(size_t index) const { return data_size_? data_ + plane(index).offset : nullptr; }
+	uint8_t* plane_data(size_t index) { return data_size_? data_ + plane(index).offset : nullptr; }
+
+	uint8_t const* data() const { return data_size_? data_ : nullptr; }
+	uint8_t* data() { return data_size_? data_ : nullptr; }
+
+	size_t data_size() const { return data_size_; }
 
-	size_t data_size() const { return data_.size(); }
+	/// Requested pixel data allocation
+	allocation get_allocation() const { return allocation_; }
 
+	/// Is pixel data memory mapped, i.e. huge page allocation has not fallen back to heap
+	bool is_mapped() const { return mapped_; }
+
+	/// External pixel data storage, if any
+	boost::shared_ptr<bitmap_storage> const& storage() const { return storage_; }
+
+	/// Lock for pixel data access, frames published with frame_publisher
+	/// are immutable and read without it
 	boost::shared_mutex& shared_mutex() { return shared_mutex_; }
 
 	/// Create checkerboard with lines between checkers
@@ -112,17 +205,35 @@ public:
 	void checker2(const uint32_t c1 = 0x00000000, const uint32_t c2 = 0xffffffff);
 
 private:
+	void layout(image_size const& size, encoding pixel_format);
+	void allocate(size_t size, encoding pixel_format);
+	void deallocate();
+
 	boost::shared_mutex shared_mutex_;
 
 	image_size size_;
-	std::vector<uint8_t, aligned_allocator<uint8_t, 32>> data_;
 	encoding pixel_format_;
+	allocation allocation_;
+	size_t row_alignment_;
+
+	uint8_t* data_;     // 32-byte aligned pixel data
+	size_t data_size_;  // used bytes in data_
+	size_t capacity_;   // allocated bytes in data_
+	bool mapped_;       // data_ is allocated with mmap
+	boost::shared_ptr<bitmap_storage> storage_; // owner of external data_
 
-	static size_t total_memory_;
+	plane_layout planes_[max_planes];
+	size_t plane_count_;
 };
 
 typedef boost::shared_ptr<bitmap> shared_bitmap;
 
+/// Monotonic time in nanoseconds for frame timestamps
+inline uint64_t monotonic_time()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 class IMAGE_API shared_bitmap_container
 {
 public:
@@ -136,12 +247,22 @@ public:
 
 	shared_bitmap_container()
 		: flags_(DEFAULT)
+		, sequence_(0)
+		, capture_time_(0)
+		, acquire_time_(0)
+		, schedule_time_(0)
+		, presentation_time_(0)
 	{
 	}
 
 	shared_bitmap_container(shared_bitmap color, uint32_t flags)
 		: color_(color)
 		, flags_(flags)
+		, sequence_(0)
+		, capture_time_(0)
+		, acquire_time_(0)
+		, schedule_time_(0)
+		, presentation_time_(0)
 	{
 	}
 
@@ -149,6 +270,11 @@ public:
 		: color_(color)
 		, alpha_(alpha)
 		, flags_(flags)
+		, sequence_(0)
+		, capture_time_(0)
+		, acquire_time_(0)
+		, schedule_time_(0)
+		, presentation_time_(0)
 	{
 	}
 
@@ -161,25 +287,255 @@ public:
 	uint32_t flags() const { return flags_; }
 	void set_flags(uint32_t flags) { flags_ = flags; }
 
+	/// Input frame number in the device, starting from 1
+	uint64_t sequence() const { return sequence_; }
+	void set_sequence(uint64_t sequence) { sequence_ = sequence; }
+
+	/// Frame timestamps in monotonic_time() nanoseconds, 0 if not set
+	uint64_t capture_time() const { return capture_time_; }
+	void set_capture_time(uint64_t time) { capture_time_ = time; }
+
+	uint64_t acquire_time() const { return acquire_time_; }
+	void set_acquire_time(uint64_t time) { acquire_time_ = time; }
+
+	uint64_t schedule_time() const { return schedule_time_; }
+	void set_schedule_time(uint64_t time) { schedule_time_ = time; }
+
+	/// Time to present output frame at, 0 for as soon as possible
+	uint64_t presentation_time() const { return presentation_time_; }
+	void set_presentation_time(uint64_t time) { presentation_time_ = time; }
+
+	/// Clear sequence number and timestamps, e.g. for frame reuse
+	void reset_timestamps() { sequence_ = capture_time_ = acquire_time_ = schedule_time_ = presentation_time_ = 0; }
+
 private:
-	shared_bitmap color_;	// source data
+	shared_bitmap color_;	// source data, planar YUV formats keep all planes in it
 	shared_bitmap alpha_;	// separate alpha (if available)
 	uint32_t      flags_;
+	uint64_t      sequence_;
+	uint64_t      capture_time_;	// captured by device
+	uint64_t      acquire_time_;	// acquired by consumer
+	uint64_t      schedule_time_;	// scheduled for output
+	uint64_t      presentation_time_;	// requested output time
+};
+
+/// Lock-free log-linear histogram of latencies in nanoseconds, values
+/// are kept with 1/32 relative precision up to about 18 minutes
+class IMAGE_API latency_histogram : boost::noncopyable
+{
+public:
+	/// Histogram summary, in nanoseconds
+	struct summary
+	{
+		uint64_t count;
+		uint64_t min;
+		uint64_t max;
+		double mean;
+		uint64_t p50;
+		uint64_t p90;
+		uint64_t p99;
+		uint64_t p999;
+	};
+
+	latency_histogram();
+
+	/// Record a latency value
+	void record(uint64_t ns);
+
+	/// Latency at percentile in [0..100], 0 for empty histogram
+	uint64_t percentile(double p) const;
+
+	summary get_summary() const;
+
+	/// Summary object with values in milliseconds
+	v8::Handle<v8::Value> get_info(v8::Isolate* isolate) const;
+
+	void reset();
+
+private:
+	static unsigned const sub_bucket_bits = 5;
+	static unsigned const sub_bucket_count = 1 << sub_bucket_bits;
+	static unsigned const max_value_bits = 40;
+	static unsigned const bucket_count = (max_value_bits - sub_bucket_bits + 1) * sub_bucket_count;
+
+	static unsigned bucket_index(uint64_t ns);
+	static uint64_t bucket_value(unsigned index);
+
+	std::atomic<uint64_t> buckets_[bucket_count];
+	std::atomic<uint64_t> count_;
+	std::atomic<uint64_t> sum_;
+	std::atomic<uint64_t> min_;
+	std::atomic<uint64_t> max_;
+};
+
+/// Bounded lock-free multi-producer multi-consumer ring of frames.
+///
+/// Frames are passed through cells with sequence numbers, so producers and
+/// consumers synchronize only on atomic cell and index updates. Waiting for
+/// a frame or for free space uses the wait strategy, only the BLOCK one
+/// makes a system call, and only when there is a waiting thread.
+class IMAGE_API frame_ring : boost::noncopyable
+{
+public:
+	enum wait_strategy
+	{
+		SPIN,  ///< busy wait, lowest latency, burns a core while waiting
+		YIELD, ///< busy wait yielding the core to other threads
+		BLOCK, ///< spin shortly, then sleep on futex (condition variable on non-Linux)
+	};
+
+	/// Create ring for capacity frames, rounded up to a power of 2, at least 2.
+	/// In overwrite_oldest mode push() drops the oldest frame when the ring is full.
+	explicit frame_ring(size_t capacity, wait_strategy wait = BLOCK, bool overwrite_oldest = false);
+	~frame_ring();
+
+	size_t capacity() const { return mask_ + 1; }
+	wait_strategy get_wait_strategy() const { return wait_; }
+
+	bool overwrite_oldest() const { return overwrite_oldest_.load(std::memory_order_relaxed); }
+	void set_overwrite_oldest(bool overwrite_oldest) { overwrite_oldest_.store(overwrite_oldest, std::memory_order_relaxed); }
+
+	/// Maximum number of frames in the ring, the ring is full with depth
+	/// frames in it. Depth is in [1..capacity], capacity by default.
+	size_t depth() const { return depth_.load(std::memory_order_relaxed); }
+	void set_depth(size_t depth);
+
+	/// Approximate number of frames in the ring
+	size_t size() const;
+	bool empty() const { return size() == 0; }
+
+	/// Push frame if there is a free cell, returns false if the ring is full.
+	/// Depth other than 0 overrides the ring depth for this push.
+	bool try_push(shared_bitmap_container const& frame, size_t depth = 0);
+
+	/// Push frame, dropping the oldest ones in overwrite_oldest mode or
+	/// waiting for a free cell otherwise. Returns false if a frame was dropped.
+	bool push(shared_bitmap_container const& frame);
+
+	/// Push frame waiting at most timeout_ms for a free cell, -1 to wait
+	/// forever. Returns false on timeout. Never drops frames. Depth other
+	/// than 0 overrides the ring depth for this push.
+	bool push_for(shared_bitmap_container const& frame, int timeout_ms, size_t depth = 0);
+
+	/// Pop the oldest frame, returns false if the ring is empty
+	bool try_pop(shared_bitmap_container& frame);
+
+	/// Pop the oldest frame, waiting for it
+	void wait_and_pop(shared_bitmap_container& frame) { pop_for(frame, -1); }
+
+	/// Pop the oldest frame waiting at most timeout_ms, -1 to wait forever.
+	/// Returns false on timeout.
+	bool pop_for(shared_bitmap_container& frame, int timeout_ms);
+
+	/// Drop all frames in the ring
+	void clear();
+
+	/// Number of frames dropped by push() in overwrite_oldest mode
+	uint64_t overwritten() const { return overwritten_.load(std::memory_order_relaxed); }
+
+private:
+	static size_t const cache_line_size = 64;
+
+	struct cell
+	{
+		std::atomic<size_t> sequence;
+		shared_bitmap_container frame;
+		char padding[cache_line_size - (sizeof(std::atomic<size_t>) + sizeof(shared_bitmap_container)) % cache_line_size];
+	};
+
+	// wake up for threads waiting in the BLOCK strategy
+	struct waiter
+	{
+		std::atomic<uint32_t> sequence;
+		std::atomic<uint32_t> count;
+#if !OS(LINUX)
+		boost::mutex mutex;
+		boost::condition_variable cond;
+#endif
+		waiter() : sequence(0), count(0) {}
+	};
+
+	template<typename Ready>
+	bool wait(waiter& w, Ready ready, int timeout_ms);
+	void notify(waiter& w);
+
+	// cells are cache line aligned, new[] doesn't align over-aligned types
+	static cell* allocate_cells(size_t count);
+	static void free_cells(cell* cells, size_t count);
+
+	cell* const cells_;
+	size_t const mask_;
+	wait_strategy const wait_;
+	std::atomic<bool> overwrite_oldest_;
+	std::atomic<size_t> depth_;
+
+	char padding0_[cache_line_size];
+	std::atomic<size_t> tail_; // next push position
+	char padding1_[cache_line_size - sizeof(std::atomic<size_t>)];
+	std::atomic<size_t> head_; // next pop position
+	char padding2_[cache_line_size - sizeof(std::atomic<size_t>)];
+
+	std::atomic<uint64_t> overwritten_;
+	waiter not_empty_;
+	waiter not_full_;
 };
 
 class IMAGE_API device
 {
 public:
+	/// Maximum number of input frames pending for consumers
+	static size_t const capture_queue_capacity = 64;
+	/// Released frames ready for reuse by the device
+	static size_t const available_queue_capacity = 64;
+	/// Default producer wait for schedule_input_frame() without drop_frames
+	static int const default_lossless_timeout_ms = 1000;
+
+	/// What schedule_input_frame() does with frames over the queue depth
+	enum drop_policy
+	{
+		DROP_OLDEST,    ///< queue up to depth frames, the oldest pending frame is dropped
+		MAILBOX,        ///< keep only the latest frame, a pending one is replaced
+		DROP_NEWEST,    ///< queue up to depth frames, the new frame is dropped
+		BLOCK_PRODUCER, ///< queue up to depth frames, wait for a free slot up to timeout, then drop the new frame
+	};
+
+	/// Input frame counters
+	struct frame_stats
+	{
+		uint64_t scheduled;      ///< frames passed to schedule_input_frame()
+		uint64_t queued;         ///< frames put into the capture queue
+		uint64_t dropped_oldest; ///< pending frames replaced by newer ones
+		uint64_t dropped_newest; ///< new frames dropped on full queue
+		uint64_t blocked;        ///< frames the producer had to wait for a free slot
+		uint64_t block_timeouts; ///< frames dropped after waiting for a free slot
+	};
+
 	explicit device(char const* name = "N/A")
 		: name_(name? name : "")
 		, encoding_(UNKNOWN)
 		, dropped_frames_(0)
-		, trace_dropped_frames_(false)
+		, drop_policy_(DROP_OLDEST)
+		, block_timeout_ms_(0)
+		, lossless_timeout_ms_(default_lossless_timeout_ms)
+		, scheduled_frames_(0)
+		, queued_frames_(0)
+		, dropped_oldest_(0)
+		, dropped_newest_(0)
+		, blocked_frames_(0)
+		, block_timeouts_(0)
+		, next_sequence_(0)
+		, input_waiters_(0)
+		, input_event_fd_(-1)
+		, capture_queue_(capture_queue_capacity, frame_ring::BLOCK)
+		, available_queue_(available_queue_capacity, frame_ring::BLOCK)
 	{
+		set_drop_policy(DROP_OLDEST, 2);
+		open_input_event();
 	}
 
 	virtual ~device()
 	{
+		close_input_event();
 	}
 
 	encoding get_encoding() const { return encoding_; }
@@ -187,22 +543,102 @@ public:
 
 	uint32_t get_dropped_frames() const { return dropped_frames_; }
 
+	/// Set input frame drop policy with queue depth in [1..capture_queue_capacity],
+	/// ignored for MAILBOX, and producer wait timeout for BLOCK_PRODUCER, -1 to wait
+	/// forever. Default is DROP_OLDEST with depth 2.
+	void set_drop_policy(drop_policy policy, size_t depth = 2, int block_timeout_ms = -1);
+	drop_policy get_drop_policy() const { return static_cast<drop_policy>(drop_policy_.load(std::memory_order_relaxed)); }
+	size_t get_queue_depth() const { return capture_queue_.depth(); }
+
+	/// Set how long schedule_input_frame() without drop_frames waits for a
+	/// free slot, -1 to wait forever, default_lossless_timeout_ms by default
+	void set_lossless_timeout(int timeout_ms) { lossless_timeout_ms_.store(timeout_ms, std::memory_order_relaxed); }
+	int get_lossless_timeout() const { return lossless_timeout_ms_.load(std::memory_order_relaxed); }
+
+	frame_stats get_frame_stats() const;
+
 	virtual v8::Handle<v8::Value> get_info(v8::Isolate* isolate) const;
 
-	virtual bool acquire_input_frame(shared_bitmap_container& frame) { return capture_queue_.try_pop(frame); }
-	virtual void acquire_input_frame_blocking(shared_bitmap_container& frame) { return capture_queue_.wait_and_pop(frame); }
-	virtual void release_input_frame(shared_bitmap_container const& frame) { available_queue_.push(frame); }
+	/// Latency histograms: input frame capture to acquire by consumer,
+	/// acquire to release, and output frame schedule to output
+	latency_histogram const& capture_to_acquire() const { return capture_to_acquire_; }
+	latency_histogram const& acquire_to_release() const { return acquire_to_release_; }
+	latency_histogram const& schedule_to_output() const { return schedule_to_output_; }
+
+	virtual bool acquire_input_frame(shared_bitmap_container& frame);
+	virtual void acquire_input_frame_blocking(shared_bitmap_container& frame);
+
+	/// Acquire input frame waiting at most timeout_ms, -1 to wait forever.
+	/// Returns false on timeout.
+	virtual bool acquire_input_frame_for(shared_bitmap_container& frame, int timeout_ms);
+
+	/// Append up to max pending input frames to frames, waiting at most
+	/// timeout_ms for the first one. Returns number of acquired frames.
+	virtual size_t acquire_input_frames(std::vector<shared_bitmap_container>& frames, size_t max, int timeout_ms = 0);
+
+	/// Are there input frames to acquire
+	bool has_input_frames() const { return !capture_queue_.empty(); }
+
+	/// Event file descriptor readable when input frames are queued while
+	/// someone waits in wait_input_frames(), -1 where eventfd is unavailable
+	int input_event_fd() const { return input_event_fd_; }
+
+	/// Wait for input frames in any of devices at most timeout_ms, -1 to wait
+	/// forever. Returns index of the first device with input frames, or -1 on
+	/// timeout. Waits on device input event descriptors with poll() on Linux,
+	/// polls the devices each millisecond elsewhere and for devices without one.
+	static int wait_input_frames(device* const* devices, size_t count, int timeout_ms);
+
+	static int wait_input_frames(std::vector<device*> const& devices, int timeout_ms)
+	{
+		return wait_input_frames(devices.data(), devices.size(), timeout_ms);
+	}
+	virtual void release_input_frame(shared_bitmap_container const& frame);
 	virtual void schedule_output_frame(shared_bitmap_container const&) { _aspect_assert(false && "aspecet::image::device::schedule_output_frame() is not overloaded"); }
+
+	/// Queue captured frame for consumers according to the drop policy.
+	/// Without drop_frames the drop policy is ignored: frames are queued up
+	/// to capture_queue_capacity, then the producer blocks for a free slot
+	/// up to the lossless timeout and the frame is dropped as a block timeout.
+	/// The frame gets a sequence number, and capture time unless it is set.
 	virtual void schedule_input_frame(shared_bitmap_container const& frame, bool drop_frames);
 
 protected:
+	void drop_input_frame(std::atomic<uint64_t>& counter);
+	void input_frame_queued();
+	void open_input_event();
+	void close_input_event();
+
+	/// Stamp acquired input frame and record its capture latency
+	void input_frame_acquired(shared_bitmap_container& frame);
+
+	/// Record latency of output frame with schedule time set, to call on its output
+	void output_frame_presented(shared_bitmap_container const& frame);
+
 	std::string name_;
 	encoding encoding_;
-	uint32_t dropped_frames_;
-	bool trace_dropped_frames_;
-
-	threads::concurrent_queue<shared_bitmap_container> capture_queue_;
-	threads::concurrent_queue<shared_bitmap_container> available_queue_;
+	std::atomic<uint32_t> dropped_frames_;
+
+	std::atomic<int> drop_policy_;
+	std::atomic<int> block_timeout_ms_;
+	std::atomic<int> lossless_timeout_ms_;
+
+	std::atomic<uint64_t> scheduled_frames_;
+	std::atomic<uint64_t> queued_frames_;
+	std::atomic<uint64_t> dropped_oldest_;
+	std::atomic<uint64_t> dropped_newest_;
+	std::atomic<uint64_t> blocked_frames_;
+	std::atomic<uint64_t> block_timeouts_;
+	std::atomic<uint64_t> next_sequence_;
+	std::atomic<uint32_t> input_waiters_; // threads in wait_input_frames()
+	int input_event_fd_;
+
+	latency_histogram capture_to_acquire_;
+	latency_histogram acquire_to_release_;
+	latency_histogram schedule_to_output_;
+
+	frame_ring capture_queue_;
+	frame_ring available_queue_;
 };
 
 }} // aspect::image
@@ -0,0 +1,82 @@
+#ifndef IMAGE_MEMORY_HPP_INCLUDED
+#define IMAGE_MEMORY_HPP_INCLUDED
+
+#include "image/image.hpp"
+
+#include <atomic>
+
+namespace aspect { namespace image {
+
+/// Memory usage snapshot
+struct memory_usage
+{
+	size_t bytes;              ///< live bytes
+	size_t count;              ///< live allocations
+	size_t peak_bytes;         ///< high-water mark of live bytes
+	size_t peak_count;         ///< high-water mark of live allocations
+	uint64_t allocations;      ///< total number of allocations
+	uint64_t allocated_bytes;  ///< total allocated bytes
+	double time;               ///< snapshot time in seconds, steady clock
+
+	/// Allocations per second since an earlier snapshot
+	double allocation_rate(memory_usage const& earlier) const;
+
+	/// Allocated bytes per second since an earlier snapshot
+	double allocated_bytes_rate(memory_usage const& earlier) const;
+};
+
+/// Lock-free memory usage counter
+class IMAGE_API memory_counter : boost::noncopyable
+{
+public:
+	memory_counter();
+
+	/// Account bytes, as a new allocation or as moved from another counter
+	void add(size_t bytes, bool allocation = true);
+
+	/// Account freed or moved away bytes
+	void remove(size_t bytes);
+
+	/// Current usage
+	memory_usage usage() const;
+
+	/// Reset high-water marks to the current usage
+	void reset_peak();
+
+private:
+	std::atomic<size_t> bytes_;
+	std::atomic<size_t> count_;
+	std::atomic<size_t> peak_bytes_;
+	std::atomic<size_t> peak_count_;
+	std::atomic<uint64_t> allocations_;
+	std::atomic<uint64_t> allocated_bytes_;
+};
+
+/// Bitmap memory accounting
+namespace memory {
+
+/// All bitmaps memory
+IMAGE_API memory_counter& total();
+
+/// Memory of bitmaps with the pixel format
+IMAGE_API memory_counter& for_encoding(encoding pixel_format);
+
+/// Register a named counter, e.g. of a bitmap pool, to report in get_info()
+/// Registering the same counter again changes its name.
+IMAGE_API void register_counter(memory_counter const& counter, std::string const& name);
+IMAGE_API void unregister_counter(memory_counter const& counter);
+
+/// Bitmap storage changes, called by bitmap
+void bitmap_allocated(encoding pixel_format, size_t bytes);
+void bitmap_freed(encoding pixel_format, size_t bytes);
+void bitmap_encoding_changed(encoding from, encoding to, size_t bytes);
+
+/// Memory statistics object with total, per encoding and registered counters,
+/// with allocation rates since the previous call
+IMAGE_API v8::Handle<v8::Value> get_info(v8::Isolate* isolate);
+
+} // namespace memory
+
+}} // aspect::image
+
+#endif // IMAGE_MEMORY_HPP_INCLUDED
@@ -0,0 +1,125 @@
+#ifndef IMAGE_OUTPUT_DEVICE_HPP_INCLUDED
+#define IMAGE_OUTPUT_DEVICE_HPP_INCLUDED
+
+#include "image/image.hpp"
+
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+#include <deque>
+
+namespace aspect { namespace image {
+
+/// Output device base presenting scheduled frames from a scheduler thread
+/// paced by a presentation clock: tick n is due at start_time() + n frame
+/// periods in monotonic_time() nanoseconds.
+///
+/// Frames are expected in presentation time order. On each tick the latest
+/// frame due within half a frame period is presented and older due frames
+/// are dropped. Frames without presentation time are presented one per tick.
+/// The previous frame is presented again when no frame is due.
+///
+/// Derived devices implement present_frame() and call stop() in their
+/// destructor, before present_frame() becomes unavailable.
+class IMAGE_API output_device : public device
+{
+public:
+	/// Maximum number of frames scheduled ahead
+	static size_t const output_queue_capacity = 16;
+
+	/// Output frame counters
+	struct output_stats
+	{
+		uint64_t presented;     ///< frames passed to present_frame()
+		uint64_t repeated;      ///< ticks presenting the previous frame again
+		uint64_t late;          ///< frames presented after their tick
+		uint64_t early;         ///< frames scheduled ahead, held in queue for their presentation time
+		uint64_t dropped;       ///< frames replaced by newer due frames, or scheduled on full queue while stopped
+		uint64_t skipped_ticks; ///< ticks missed by the scheduler thread
+	};
+
+	explicit output_device(char const* name = "output");
+	~output_device();
+
+	/// Start presentation clock at start_time or one frame period from now
+	/// for 0, and the scheduler thread. Returns false if already running.
+	bool start(double frame_rate, uint64_t start_time = 0);
+
+	/// Stop the scheduler thread, scheduled frames are kept
+	void stop();
+
+	bool is_running() const { return running_; }
+
+	double frame_rate() const { return frame_rate_; }
+	uint64_t start_time() const { return start_time_; }
+
+	/// Presentation clock time of tick
+	uint64_t tick_time(uint64_t tick) const
+	{
+		return start_time_ + static_cast<uint64_t>(tick * 1e9 / frame_rate_);
+	}
+
+	/// Tick due at time, or the first one before the clock start
+	uint64_t tick_at(uint64_t time) const
+	{
+		return time > start_time_? static_cast<uint64_t>((time - start_time_) * frame_rate_ / 1e9) : 0;
+	}
+
+	/// Queue frame for presentation at its presentation time, waits while
+	/// the output queue is full and the device is running
+	virtual void schedule_output_frame(shared_bitmap_container const& frame);
+
+	/// Drop scheduled frames
+	void clear();
+
+	size_t pending_frames() const;
+
+	output_stats get_output_stats() const;
+
+	/// Delay of the scheduler thread wake up after tick time
+	latency_histogram const& present_jitter() const { return present_jitter_; }
+
+	virtual v8::Handle<v8::Value> get_info(v8::Isolate* isolate) const;
+
+protected:
+	/// Present frame on tick, called from the scheduler thread.
+	/// Repeated is true when the previous frame is presented again.
+	virtual void present_frame(shared_bitmap_container const& frame, uint64_t tick, bool repeated) = 0;
+
+private:
+	struct entry
+	{
+		shared_bitmap_container frame;
+		bool early; // counted as early
+	};
+
+	void run();
+	bool sleep_until(uint64_t time);
+	bool next_frame(uint64_t time, shared_bitmap_container& frame);
+
+	double frame_rate_;
+	uint64_t start_time_;
+
+	mutable boost::mutex queue_mutex_;
+	boost::condition_variable queue_not_full_;
+	std::deque<entry> queue_;
+	shared_bitmap_container last_frame_;
+
+	boost::thread thread_;
+	std::atomic<bool> running_;
+	std::atomic<bool> stop_;
+
+	std::atomic<uint64_t> presented_frames_;
+	std::atomic<uint64_t> repeated_frames_;
+	std::atomic<uint64_t> late_frames_;
+	std::atomic<uint64_t> early_frames_;
+	std::atomic<uint64_t> dropped_output_frames_;
+	std::atomic<uint64_t> skipped_ticks_;
+
+	latency_histogram present_jitter_;
+};
+
+}} // aspect::image
+
+#endif // IMAGE_OUTPUT_DEVICE_HPP_INCLUDED
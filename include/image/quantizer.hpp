@@ -9,40 +9,162 @@ namespace aspect { namespace image {
 class IMAGE_API quantizer
 {
 public:
+	/// Maximum number of palette entries
+	static size_t const max_lut_size = 256;
+
+	/// Palette mapping method
+	enum dither_method
+	{
+		DITHER_NONE,            ///< map each pixel to the nearest palette color
+		DITHER_ORDERED,         ///< 4x4 Bayer matrix threshold dithering
+		DITHER_FLOYD_STEINBERG  ///< serpentine Floyd-Steinberg error diffusion
+	};
+
 	quantizer()
 		: lut_size_(0)
+		, palette_colors_(0)
+		, alpha_(false)
+		, dither_(DITHER_NONE)
+		, sample_size_(0)
+		, refine_iterations_(0)
+		, refine_time_budget_(0)
+		, reuse_error_(0.0f)
+		, palette_error_(0.0f)
+		, palette_reused_(false)
+		, ordered_spread_(0)
+		, map_width_(0)
+		, map_row_(0)
+		, map_format_(BGRA8)
+	{
+	}
+
+	/// Set palette mapping method used in quantize()
+	void set_dither(dither_method dither) { dither_ = dither; }
+	dither_method dither() const { return dither_; }
+
+	/// Quantize with alpha channel, so translucent pixels get own palette entries.
+	/// Alpha is stored inverted as in bitmaps, 0 is opaque. Palette entries are
+	/// ordered by decreasing stored alpha then, most transparent first and opaque
+	/// last, so opaque entries can be left out of PNG tRNS.
+	void set_alpha(bool alpha) { alpha_ = alpha; }
+	bool alpha() const { return alpha_; }
+
+	/// Build palette histogram from a stratified sample of about max_pixels
+	/// for larger images, 0 to use all pixels
+	void set_sample_size(size_t max_pixels) { sample_size_ = max_pixels; }
+	size_t sample_size() const { return sample_size_; }
+
+	/// Refine Wu palette with up to iterations of k-means over the color
+	/// histogram, stop earlier after time_budget_ms if it is not 0.
+	/// 0 iterations disables the refinement.
+	void set_refinement(size_t iterations, double time_budget_ms = 0)
 	{
+		refine_iterations_ = iterations;
+		refine_time_budget_ = time_budget_ms;
 	}
-	
-	void quantize(uint8_t const* pixels, size_t stride, image_rect const& rect, size_t num_colors = 0xff);
+	size_t refinement_iterations() const { return refine_iterations_; }
+	double refinement_time_budget() const { return refine_time_budget_; }
+
+	/// Keep the palette of the previous quantize() call for a sequence of frames
+	/// while mean squared error of the new pixels mapped to it, sampled over
+	/// the rect, is not above max_error. 0 disables palette reuse.
+	void set_reuse_palette(float max_error) { reuse_error_ = max_error; }
+	float reuse_palette() const { return reuse_error_; }
+
+	/// Was the previous palette reused in the last quantize() call
+	bool palette_reused() const { return palette_reused_; }
+
+	/// Sampled mean squared error of the previous palette measured in
+	/// the last quantize() call, 0 if there was no previous palette
+	float palette_error() const { return palette_error_; }
+
+	/// Forget the palette, next quantize() call builds a new one
+	void reset_palette() { lut_size_ = 0; }
+
+	/// Build palette and map rect pixels into result_data().
+	/// Supported pixel formats are RGBA8, ARGB8, BGRA8 and RGB8.
+	void quantize(uint8_t const* pixels, size_t stride, image_rect const& rect,
+		size_t num_colors = 0xff, encoding pixel_format = BGRA8);
+
+	/// Build palette for rect pixels, or keep the previous one, see set_reuse_palette()
+	void build_palette(uint8_t const* pixels, size_t stride, image_rect const& rect,
+		size_t num_colors = 0xff, encoding pixel_format = BGRA8);
+
+	/// Map rect pixels to the palette indices into dst rows
+	void map(uint8_t const* pixels, size_t stride, image_rect const& rect,
+		uint8_t* dst, size_t dst_stride, encoding pixel_format = BGRA8);
+
+	/// Start mapping a sequence of rows with width pixels, one by one.
+	/// Dithering state is kept between map_row() calls.
+	void begin_map(size_t width, encoding pixel_format = BGRA8);
+
+	/// Map source row of pixels to the palette indices into dst
+	void map_row(uint8_t const* src, uint8_t* dst);
 
 	void clear() { result_data_.clear(); }
 
 	void const* lut24() const { return &lut_.rgb; }
-	void const* lut32() { return &lut_.rgba; }
+	void const* lut32() const { return &lut_.rgba; }
 
 	size_t lut_size() const { return lut_size_; }
+
 	uint8_t* result_data() { return &result_data_[0]; }
 
 private:
+	// build palette with Wu's algorithm and its inverse colormap
+	void create_palette(uint8_t const* pixels, size_t stride, image_rect const& rect,
+		size_t num_colors, encoding pixel_format);
+
+	// mean squared error of the rect pixels mapped to the current palette
+	float palette_error(uint8_t const* pixels, size_t stride, image_rect const& rect, encoding pixel_format) const;
+
+	template<typename Layout>
+	float sample_error(uint8_t const* pixels, size_t stride, image_rect const& rect) const;
+
+	// map row of map_width_ pixels in the Layout
+	template<typename Layout>
+	void map_pixels(uint8_t const* src, uint8_t* dst);
+
+	// build inverse colormap with the nearest palette entry for each color cell
+	void build_inverse_map();
+	size_t inverse_map_size() const;
 
 	struct lut
 	{
 		struct
 		{
 			uint8_t r,g,b;
-		} rgb[256];
+		} rgb[max_lut_size];
 
 		struct
 		{
 			uint8_t r,g,b,a;
-		} rgba[256];
+		} rgba[max_lut_size];
 	};
 
 	buffer result_data_;
 
 	lut lut_;
 	size_t lut_size_;
+	size_t palette_colors_;
+
+	bool alpha_;
+	dither_method dither_;
+
+	size_t sample_size_;
+	size_t refine_iterations_;
+	double refine_time_budget_;
+	float reuse_error_;
+	float palette_error_;
+	bool palette_reused_;
+
+	buffer inverse_map_;
+	int ordered_spread_;
+
+	size_t map_width_;
+	size_t map_row_;
+	encoding map_format_;
+	std::vector<int> errors_;
 };
 
 }} // aspect::image
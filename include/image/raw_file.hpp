@@ -0,0 +1,150 @@
+#ifndef IMAGE_RAW_FILE_HPP_INCLUDED
+#define IMAGE_RAW_FILE_HPP_INCLUDED
+
+#include "image/image.hpp"
+
+#include <boost/thread/thread.hpp>
+
+// Raw frame files for replaying and recording sessions, POSIX only
+//
+// File layout: a raw_file_header padded to raw_file_header::page_size,
+// then frames in pixel data layout of bitmap with the header size, pixel
+// format and row alignment, each frame padded to frame_stride bytes.
+// Frames are page aligned to be memory mapped and written with O_DIRECT.
+
+namespace aspect { namespace image {
+
+/// Raw frame file header, in host byte order
+struct raw_file_header
+{
+	static size_t const page_size = 4096;
+	static uint32_t const current_version = 1;
+	static uint32_t const max_dimension = 65536; ///< width and height limit
+
+	char magic[8];          ///< "IMGRAWFR"
+	uint32_t version;
+	uint32_t header_size;   ///< page_size
+	uint32_t width;
+	uint32_t height;
+	uint32_t pixel_format;  ///< encoding
+	uint32_t row_alignment;
+	uint64_t frame_size;    ///< bitmap data size
+	uint64_t frame_stride;  ///< frame_size rounded up to page size
+	uint64_t frame_count;   ///< 0 for unfinished files, frames till the file end are used then
+	double frame_rate;      ///< frames per second, 0 if unknown
+
+	/// Init header for frames of size, pixel format and row alignment
+	void init(image_size const& size, encoding pixel_format, size_t row_alignment, double frame_rate);
+
+	/// Check magic, version, size limits and layout
+	bool is_valid() const;
+};
+
+/// Input device replaying frames of a memory mapped raw frame file.
+/// Frames are published zero-copy as bitmaps over the copy-on-write
+/// file mapping, which is kept while the bitmaps are alive.
+class IMAGE_API replay_device : public device
+{
+public:
+	explicit replay_device(char const* name = "replay");
+	~replay_device();
+
+	/// Map raw frame file, returns false if it can't be mapped or is invalid
+	bool open(char const* path);
+
+	/// Stop replay and unmap the file, published frames keep their mapping
+	void close();
+
+	bool is_open() const { return !!mapping_; }
+
+	raw_file_header const& header() const { return header_; }
+	image_size size() const { return image_size(header_.width, header_.height); }
+	uint64_t frame_count() const { return frame_count_; }
+
+	/// Start replay at frame_rate frames per second, the file frame rate
+	/// for -1, as fast as consumers take them for 0. Replays the file in a
+	/// loop or once.
+	bool start(double frame_rate = -1, bool loop = false);
+
+	/// Stop replay and wait for the device thread
+	void stop();
+
+	bool is_running() const { return running_; }
+
+	uint64_t replayed_frames() const { return replayed_frames_; }
+
+	/// Frames are not reused, only their latency is recorded
+	virtual void release_input_frame(shared_bitmap_container const& frame);
+
+	virtual v8::Handle<v8::Value> get_info(v8::Isolate* isolate) const;
+
+private:
+	class mapping;
+
+	void run(double frame_rate, bool loop);
+
+	raw_file_header header_;
+	uint64_t frame_count_;
+	boost::shared_ptr<mapping> mapping_;
+
+	boost::thread thread_;
+	std::atomic<bool> running_;
+	std::atomic<bool> stop_;
+	std::atomic<uint64_t> replayed_frames_;
+};
+
+/// Output device appending scheduled frames to a raw frame file from a
+/// writer thread. The file is written with O_DIRECT when the file system
+/// supports it, page aligned pixel data is written without copying.
+class IMAGE_API record_device : public device
+{
+public:
+	/// Scheduled frames waiting for the writer thread
+	static size_t const write_queue_capacity = 16;
+
+	explicit record_device(char const* name = "record");
+	~record_device();
+
+	/// Create file for frames of size, pixel format and row alignment,
+	/// returns false on failure
+	bool open(char const* path, image_size const& size, encoding pixel_format,
+		double frame_rate = 0, size_t row_alignment = 1);
+
+	/// Write pending frames, finish the file header and close it
+	void close();
+
+	bool is_open() const { return fd_ >= 0; }
+	bool is_direct_io() const { return direct_io_; }
+
+	/// Queue frame for writing, waits while the write queue is full.
+	/// Frames with other size, pixel format or stride are rejected,
+	/// as well as frames waiting for the queue when the file is closed.
+	virtual void schedule_output_frame(shared_bitmap_container const& frame);
+
+	uint64_t recorded_frames() const { return recorded_frames_; }
+	uint64_t rejected_frames() const { return rejected_frames_; }
+	uint64_t write_errors() const { return write_errors_; }
+
+	virtual v8::Handle<v8::Value> get_info(v8::Isolate* isolate) const;
+
+private:
+	void run();
+	bool write_frame(bitmap const& frame, uint64_t offset);
+	bool write_header();
+
+	raw_file_header header_;
+	int fd_;
+	bool direct_io_;
+	uint8_t* staging_; // page aligned buffer for O_DIRECT writes
+	frame_ring write_queue_;
+
+	boost::thread thread_;
+	std::atomic<bool> stop_;
+	std::atomic<uint64_t> recorded_frames_;
+	std::atomic<uint64_t> rejected_frames_;
+	std::atomic<uint64_t> write_errors_;
+};
+
+}} // aspect::image
+
+#endif // IMAGE_RAW_FILE_HPP_INCLUDED
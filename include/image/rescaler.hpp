@@ -33,6 +33,7 @@ private:
 
 	int src_stride_;
 	int dst_stride_;
+	int channels_;
 
 	int src_width_, src_height_;
 	int dst_width_, dst_height_;
@@ -59,10 +60,20 @@ public:
 	void rescale(uint8_t* pixels, image_size const& src_size, int mode, image_size const& dst_size,
 		float xpos = 0.0f,float ypos = 0.0f,float xscale = 1.0f,float yscale = 1.0f);
 
+	/// Rescale pixels with 1 to 4 channels and stride bytes per row, e.g. a plane of planar image
+	void rescale(uint8_t* pixels, image_size const& src_size, int stride, int channels, int mode, image_size const& dst_size,
+		float xpos = 0.0f,float ypos = 0.0f,float xscale = 1.0f,float yscale = 1.0f);
+
 	uint8_t const* pixels() const { return data_result_; }
 	image_size size() const { return image_size(dst_width_, dst_height_); }
+	int stride() const { return dst_stride_; }
+	int channels() const { return channels_; }
 };
 
+/// Rescale src bitmap into dst size, keeping dst pixel format same as src one.
+/// Supports 8-bit formats and planes of I420 and NV12, returns false for other formats.
+IMAGE_API bool rescale(bitmap const& src, bitmap& dst, image_size const& dst_size, int mode = rescaler::BILINEAR);
+
 }} // aspect::image
 
 #endif // IMAGE_RESCALER_HPP_INCLUDED
@@ -0,0 +1,122 @@
+#ifndef IMAGE_SHARED_MEMORY_HPP_INCLUDED
+#define IMAGE_SHARED_MEMORY_HPP_INCLUDED
+
+#include "image/image.hpp"
+
+// Shared memory bitmaps for frame exchange between processes, POSIX only
+
+namespace aspect { namespace image {
+
+/// Shared memory region, memfd or unlinked POSIX shared memory object
+class IMAGE_API shared_memory : public bitmap_storage
+{
+public:
+	/// Create shared memory of size bytes, returns nullptr on failure
+	static boost::shared_ptr<shared_memory> create(size_t size);
+
+	/// Map size bytes at offset of shared memory file descriptor fd,
+	/// e.g. received from another process, returns nullptr on failure.
+	/// Fails if the file is smaller than offset + size.
+	/// The shared memory takes ownership of fd, it is closed on failure too.
+	static boost::shared_ptr<shared_memory> map(int fd, size_t size, size_t offset = 0);
+
+	~shared_memory();
+
+	int fd() const { return fd_; }
+	size_t offset() const { return offset_; }
+	size_t size() const { return size_; }
+	uint8_t* data() const { return data_; }
+
+private:
+	shared_memory(int fd, uint8_t* mapping, size_t mapping_size, size_t offset, size_t size);
+
+	int fd_;
+	uint8_t* mapping_;
+	size_t mapping_size_;
+	size_t offset_;
+	size_t size_;
+	uint8_t* data_;
+};
+
+/// Shared bitmap description to map it in another process
+struct shared_bitmap_descriptor
+{
+	static uint32_t const max_dimension = 65536;     ///< width and height limit
+	static uint32_t const max_row_alignment = 4096; ///< row alignment limit
+
+	int fd;                ///< shared memory file descriptor
+	uint64_t offset;       ///< pixel data offset in the shared memory
+	uint64_t size;         ///< pixel data size
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;       ///< row size in bytes, of luma plane for planar formats
+	uint32_t row_alignment;///< bitmap row alignment in bytes
+	encoding pixel_format;
+
+	/// Are the bitmap fields consistent, the fd and memory are not checked
+	bool is_valid() const;
+};
+
+/// Create a bitmap in a new shared memory, returns empty shared_bitmap on failure
+IMAGE_API shared_bitmap create_shared_bitmap(image_size const& size, encoding pixel_format = BGRA8,
+	size_t row_alignment = 1);
+
+/// Get descriptor of a bitmap in shared memory, false if the bitmap is not shared
+IMAGE_API bool get_shared_bitmap_descriptor(bitmap const& bmp, shared_bitmap_descriptor& descriptor);
+
+/// Map a shared bitmap by its descriptor, taking ownership of the descriptor fd.
+/// Returns empty shared_bitmap on failure.
+IMAGE_API shared_bitmap map_shared_bitmap(shared_bitmap_descriptor const& descriptor);
+
+/// Channel for passing shared bitmaps over a Unix domain socket.
+///
+/// A sent bitmap is referenced by the channel until the receiving side
+/// releases the last reference to the mapped bitmap, so the sender can
+/// recycle it, e.g. with bitmap_pool, only after the receiver is done.
+/// Release notifications are processed in receive() and process_releases().
+/// They are sent without blocking from the releasing thread, and the ones
+/// not fitting into the socket buffer are retried on the next channel call.
+/// All references held by the channel are dropped when the peer disconnects.
+class IMAGE_API shared_bitmap_channel : boost::noncopyable
+{
+public:
+	/// Create a channel over a connected Unix domain datagram or seqpacket socket,
+	/// taking ownership of the socket
+	explicit shared_bitmap_channel(int socket);
+	~shared_bitmap_channel();
+
+	/// Create a pair of connected channels, e.g. before fork()
+	static bool create_pair(boost::shared_ptr<shared_bitmap_channel>& first,
+		boost::shared_ptr<shared_bitmap_channel>& second);
+
+	/// Connect to a seqpacket socket listening on path, returns nullptr on failure
+	static boost::shared_ptr<shared_bitmap_channel> connect(char const* path);
+
+	/// Socket of the channel, e.g. to poll for readability
+	int socket() const;
+
+	/// Send a bitmap created with create_shared_bitmap() to the peer
+	bool send(shared_bitmap const& bmp);
+
+	/// Receive a bitmap from the peer, waiting at most timeout_ms milliseconds,
+	/// -1 to wait infinitely. Returns false on timeout or disconnection.
+	bool receive(shared_bitmap& bmp, int timeout_ms = -1);
+
+	/// Process release notifications from the peer without blocking,
+	/// returns number of released bitmaps
+	size_t process_releases();
+
+	/// Number of sent bitmaps not released by the peer yet
+	size_t in_flight() const;
+
+	/// Is the peer still connected
+	bool is_connected() const;
+
+private:
+	class impl;
+	boost::shared_ptr<impl> impl_;
+};
+
+}} // aspect::image
+
+#endif // IMAGE_SHARED_MEMORY_HPP_INCLUDED
@@ -0,0 +1,86 @@
+#ifndef IMAGE_TEST_SOURCE_HPP_INCLUDED
+#define IMAGE_TEST_SOURCE_HPP_INCLUDED
+
+#include "image/image.hpp"
+
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+#include <vector>
+
+namespace aspect { namespace image {
+
+/// Software input device generating frames at a configured rate from its
+/// own thread, a reproducible load for capture pipeline benchmarks.
+///
+/// Patterns are generated in BGRA8 and converted to the device pixel format.
+/// Frames released by consumers are reused.
+class IMAGE_API test_source_device : public device
+{
+public:
+	enum pattern
+	{
+		CHECKER2, ///< checkerboard without lines, bitmap::checker2()
+		CHECKER3, ///< checkerboard with lines, bitmap::checker3()
+		GRADIENT, ///< gradient moving horizontally by 4 pixels per frame
+		NOISE,    ///< random pixels, worst case for encoders
+		CLIP,     ///< frames set with set_clip(), played in a loop
+	};
+
+	explicit test_source_device(char const* name = "test source");
+	~test_source_device();
+
+	/// Start generating frames of size and pixel format, frame_rate frames
+	/// per second or as fast as consumers take them for 0. Returns false
+	/// if the device is running, the format is not convertible from BGRA8,
+	/// or CLIP pattern is selected without clip frames.
+	bool start(image_size const& size, encoding pixel_format, double frame_rate, pattern p = CHECKER3);
+
+	/// Stop generating frames and wait for the device thread
+	void stop();
+
+	bool is_running() const { return running_; }
+
+	/// Change pattern of the generated frames
+	void set_pattern(pattern p) { pattern_ = p; }
+	pattern get_pattern() const { return pattern_; }
+
+	/// Set frames for CLIP pattern, they are rescaled to the device size and
+	/// converted to its pixel format on the next start()
+	void set_clip(std::vector<shared_bitmap> const& frames);
+
+	/// Drop frames according to the drop policy when consumers are late, true
+	/// by default. Without dropping the device thread waits for consumers.
+	void set_drop_frames(bool drop_frames) { drop_frames_ = drop_frames; }
+
+	uint64_t generated_frames() const { return generated_frames_; }
+
+	/// Frames generated more than a frame period after their due time
+	uint64_t late_frames() const { return late_frames_; }
+
+	virtual v8::Handle<v8::Value> get_info(v8::Isolate* isolate) const;
+
+private:
+	void run();
+	shared_bitmap_container next_frame();
+	void generate(bitmap& frame, bitmap& pattern_bitmap, uint64_t frame_index);
+
+	image_size size_;
+	double frame_rate_;
+	std::atomic<pattern> pattern_;
+	std::atomic<bool> drop_frames_;
+
+	boost::mutex clip_mutex_;
+	std::vector<shared_bitmap> clip_;
+	std::vector<shared_bitmap> clip_frames_; // clip in the device size and format
+
+	boost::thread thread_;
+	std::atomic<bool> running_;
+	std::atomic<bool> stop_;
+	std::atomic<uint64_t> generated_frames_;
+	std::atomic<uint64_t> late_frames_;
+};
+
+}} // aspect::image
+
+#endif // IMAGE_TEST_SOURCE_HPP_INCLUDED
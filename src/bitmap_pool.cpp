@@ -0,0 +1,323 @@
+#include "image/bitmap_pool.hpp"
+
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <deque>
+#include <map>
+#include <memory>
+#include <vector>
+
+namespace aspect { namespace image {
+
+class bitmap_pool::impl : public boost::enable_shared_from_this<impl>
+{
+public:
+	impl(size_t max_free_per_key, size_t max_free_bytes, allocation alloc, size_t row_alignment)
+		: max_free_per_key_(max_free_per_key)
+		, max_free_bytes_(max_free_bytes)
+		, allocation_(alloc)
+		, row_alignment_(row_alignment)
+		, age_(0)
+	{
+		stats_ = stats();
+
+		static std::atomic<unsigned> pool_id(0);
+		memory::register_counter(memory_, "bitmap_pool#" + std::to_string(++pool_id));
+	}
+
+	~impl()
+	{
+		memory::unregister_counter(memory_);
+	}
+
+	void set_name(std::string const& name)
+	{
+		memory::register_counter(memory_, name);
+	}
+
+	shared_bitmap acquire(image_size const& size, encoding pixel_format)
+	{
+		key const k(size, pixel_format);
+		std::unique_ptr<bitmap> result;
+		size_t bytes = 0;
+		{
+			boost::mutex::scoped_lock lock(mutex_);
+
+			free_list::iterator it = free_.find(k);
+			if (it != free_.end() && !it->second.empty())
+			{
+				// most recently returned bitmap is the most likely to be in cache
+				result = std::move(it->second.back().bmp);
+				bytes = it->second.back().bytes;
+				it->second.pop_back();
+				--stats_.free_count;
+				stats_.free_bytes -= bytes;
+				++stats_.hits;
+			}
+			else
+			{
+				++stats_.misses;
+			}
+			++stats_.in_use;
+		}
+
+		if (!result)
+		{
+			result.reset(new bitmap(size, pixel_format, allocation_, row_alignment_));
+			bytes = result->data_size();
+			memory_.add(bytes);
+		}
+
+		// the bitmap may be resized while in use, it is accounted and
+		// returned by its key and size at acquire time
+		boost::weak_ptr<impl> pool = shared_from_this();
+		return shared_bitmap(result.release(), [pool, k, bytes](bitmap* bmp) { release(pool, bmp, k, bytes); });
+	}
+
+	void set_limits(size_t max_free_per_key, size_t max_free_bytes)
+	{
+		// bitmaps over the limits are freed outside of the lock
+		std::vector<entry> dropped;
+
+		boost::mutex::scoped_lock lock(mutex_);
+
+		max_free_per_key_ = max_free_per_key;
+		max_free_bytes_ = max_free_bytes;
+
+		if (max_free_per_key_)
+		{
+			for (free_list::iterator it = free_.begin(); it != free_.end(); ++it)
+			{
+				while (it->second.size() > max_free_per_key_)
+				{
+					drop_front_locked(it->second, dropped);
+				}
+			}
+		}
+		if (max_free_bytes_)
+		{
+			trim_locked(max_free_bytes_, dropped);
+		}
+	}
+
+	size_t max_free_per_key() const
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		return max_free_per_key_;
+	}
+
+	size_t max_free_bytes() const
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		return max_free_bytes_;
+	}
+
+	allocation get_allocation() const
+	{
+		return allocation_;
+	}
+
+	size_t row_alignment() const
+	{
+		return row_alignment_;
+	}
+
+	void trim(size_t max_free_bytes)
+	{
+		std::vector<entry> dropped;
+
+		boost::mutex::scoped_lock lock(mutex_);
+		trim_locked(max_free_bytes, dropped);
+	}
+
+	stats get_stats() const
+	{
+		boost::mutex::scoped_lock lock(mutex_);
+		stats result = stats_;
+		result.memory = memory_.usage();
+		return result;
+	}
+
+private:
+	struct key
+	{
+		int width, height;
+		encoding pixel_format;
+
+		key(image_size const& size, encoding pixel_format)
+			: width(size.width)
+			, height(size.height)
+			, pixel_format(pixel_format)
+		{
+		}
+
+		bool operator<(key const& other) const
+		{
+			if (width != other.width) return width < other.width;
+			if (height != other.height) return height < other.height;
+			return pixel_format < other.pixel_format;
+		}
+	};
+
+	struct entry
+	{
+		std::unique_ptr<bitmap> bmp;
+		size_t bytes; // allocated at acquire time
+		uint64_t age;
+	};
+
+	typedef std::map<key, std::deque<entry>> free_list;
+
+	static void release(boost::weak_ptr<impl> const& pool, bitmap* bmp, key const& k, size_t bytes)
+	{
+		std::unique_ptr<bitmap> owned(bmp);
+		if (boost::shared_ptr<impl> self = pool.lock())
+		{
+			self->put(std::move(owned), k, bytes);
+		}
+	}
+
+	void put(std::unique_ptr<bitmap> bmp, key const& k, size_t bytes)
+	{
+		// the bitmaps are freed outside of the lock when they can't be kept
+		std::unique_ptr<bitmap> rejected;
+		std::vector<entry> dropped;
+
+		boost::mutex::scoped_lock lock(mutex_);
+		--stats_.in_use;
+
+		bool const changed = bmp->size().width != k.width || bmp->size().height != k.height
+			|| bmp->pixel_format() != k.pixel_format || bmp->data_size() != bytes;
+		std::deque<entry>& list = free_[k];
+		if (changed
+			|| (max_free_per_key_ && list.size() >= max_free_per_key_)
+			|| (max_free_bytes_ && bytes > max_free_bytes_))
+		{
+			++stats_.dropped;
+			memory_.remove(bytes);
+			rejected = std::move(bmp);
+			return;
+		}
+
+		entry e;
+		e.bmp = std::move(bmp);
+		e.bytes = bytes;
+		e.age = age_++;
+		list.push_back(std::move(e));
+		++stats_.free_count;
+		stats_.free_bytes += bytes;
+
+		if (max_free_bytes_)
+		{
+			trim_locked(max_free_bytes_, dropped);
+		}
+	}
+
+	// move the oldest free bitmap of the list to dropped
+	void drop_front_locked(std::deque<entry>& list, std::vector<entry>& dropped)
+	{
+		memory_.remove(list.front().bytes);
+		stats_.free_bytes -= list.front().bytes;
+		--stats_.free_count;
+		++stats_.dropped;
+		dropped.push_back(std::move(list.front()));
+		list.pop_front();
+	}
+
+	void trim_locked(size_t max_free_bytes, std::vector<entry>& dropped)
+	{
+		while (stats_.free_bytes > max_free_bytes)
+		{
+			// find the oldest free bitmap among all sizes and formats
+			free_list::iterator oldest = free_.end();
+			for (free_list::iterator it = free_.begin(); it != free_.end(); ++it)
+			{
+				if (!it->second.empty()
+					&& (oldest == free_.end() || it->second.front().age < oldest->second.front().age))
+				{
+					oldest = it;
+				}
+			}
+			if (oldest == free_.end())
+			{
+				break;
+			}
+
+			drop_front_locked(oldest->second, dropped);
+			if (oldest->second.empty())
+			{
+				free_.erase(oldest);
+			}
+		}
+	}
+
+	mutable boost::mutex mutex_;
+	free_list free_;
+	size_t max_free_per_key_;
+	size_t max_free_bytes_;
+	allocation const allocation_;
+	size_t const row_alignment_;
+	uint64_t age_;
+	stats stats_;
+	memory_counter memory_;
+};
+
+bitmap_pool::bitmap_pool(size_t max_free_per_key, size_t max_free_bytes, allocation alloc, size_t row_alignment)
+	: impl_(boost::make_shared<impl>(max_free_per_key, max_free_bytes, alloc, row_alignment))
+{
+}
+
+bitmap_pool::~bitmap_pool()
+{
+	// bitmaps still in use are freed on release, since the weak
+	// references to the pool implementation are expired
+}
+
+shared_bitmap bitmap_pool::acquire(image_size const& size, encoding pixel_format)
+{
+	return impl_->acquire(size, pixel_format);
+}
+
+void bitmap_pool::set_limits(size_t max_free_per_key, size_t max_free_bytes)
+{
+	impl_->set_limits(max_free_per_key, max_free_bytes);
+}
+
+size_t bitmap_pool::max_free_per_key() const
+{
+	return impl_->max_free_per_key();
+}
+
+size_t bitmap_pool::max_free_bytes() const
+{
+	return impl_->max_free_bytes();
+}
+
+void bitmap_pool::set_name(std::string const& name)
+{
+	impl_->set_name(name);
+}
+
+allocation bitmap_pool::get_allocation() const
+{
+	return impl_->get_allocation();
+}
+
+size_t bitmap_pool::row_alignment() const
+{
+	return impl_->row_alignment();
+}
+
+void bitmap_pool::trim(size_t max_free_bytes)
+{
+	impl_->trim(max_free_bytes);
+}
+
+bitmap_pool::stats bitmap_pool::get_stats() const
+{
+	return impl_->get_stats();
+}
+
+}} // aspect::image
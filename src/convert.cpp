@@ -0,0 +1,1068 @@
+#include "image/image.hpp"
+#include "image/convert.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+#include <boost/thread/thread.hpp>
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define IMAGE_CONVERT_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define IMAGE_TARGET(isa)
+#else
+#define IMAGE_TARGET(isa) __attribute__((target(isa)))
+#endif
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define IMAGE_CONVERT_NEON 1
+#include <arm_neon.h>
+#endif
+
+namespace aspect { namespace image {
+
+// Byte positions of color channels in a pixel of RGB formats
+struct pixel_channels
+{
+	static uint8_t const NONE = 0xFF;
+
+	uint8_t r, g, b, a;
+	uint8_t size;
+};
+
+static bool get_channels(encoding format, pixel_channels& ch)
+{
+	static pixel_channels const rgba8 = { 0, 1, 2, 3, 4 };
+	static pixel_channels const argb8 = { 1, 2, 3, 0, 4 };
+	static pixel_channels const bgra8 = { 2, 1, 0, 3, 4 };
+	static pixel_channels const rgb8  = { 0, 1, 2, pixel_channels::NONE, 3 };
+
+	switch (format)
+	{
+	case RGBA8: ch = rgba8; return true;
+	case ARGB8: ch = argb8; return true;
+	case BGRA8: ch = bgra8; return true;
+	case RGB8:  ch = rgb8;  return true;
+	default:    return false;
+	}
+}
+
+// YUV <-> RGB coefficients for 8-bit limited range
+struct yuv_coefficients
+{
+	// YUV to RGB
+	double y, rv, gu, gv, bu;
+	// RGB to YUV
+	double yr, yg, yb, ur, ug, ub, vr, vg, vb;
+};
+
+static yuv_coefficients const bt601 =
+{
+	1.164, 1.596, -0.392, -0.813, 2.017,
+	0.257, 0.504, 0.098, -0.148, -0.291, 0.439, 0.439, -0.368, -0.071,
+};
+
+static yuv_coefficients const bt709 =
+{
+	1.164, 1.793, -0.213, -0.533, 2.112,
+	0.183, 0.614, 0.062, -0.101, -0.339, 0.439, 0.439, -0.399, -0.040,
+};
+
+// 16.16 fixed point
+static inline int32_t fixed16(double v)
+{
+	return static_cast<int32_t>(std::floor(v * 65536 + 0.5));
+}
+
+static inline uint8_t clamp8(int32_t v)
+{
+	return static_cast<uint8_t>(v < 0? 0 : v > 255? 255 : v);
+}
+
+struct row_converter;
+typedef void (*row_function)(row_converter const& conv, uint8_t const* src, uint8_t* dst, size_t width);
+
+// Converter of pixel rows between two formats with a direct kernel
+struct row_converter
+{
+	row_function function;
+	encoding from, to;
+	pixel_channels src, dst;
+	uint8_t alpha;
+
+	// YUV <-> RGB, 16.16 fixed point
+	int32_t y, rv, gu, gv, bu;
+	int32_t yr, yg, yb, ur, ug, ub, vr, vg, vb;
+
+	// YUV to RGB for SIMD, coefficient c = int + frac / 32768
+	int16_t y_int, y_frac, rv_int, rv_frac, gu_int, gu_frac, gv_int, gv_frac, bu_int, bu_frac;
+
+	// byte shuffle and alpha fill for SIMD, the same pattern in both 128-bit lanes
+	uint8_t mask[32];
+	uint8_t fill[32];
+
+	void operator()(uint8_t const* s, uint8_t* d, size_t width) const { function(*this, s, d, width); }
+};
+
+// Row size in bytes for conversion buffers
+static size_t row_size(encoding format, size_t width)
+{
+	switch (format)
+	{
+	case YUV8:  return (width + 1) / 2 * 4;
+	case YUV10: return (width + 5) / 6 * 16;
+	default:    return width * bitmap::bytes_per_pixel(format);
+	}
+}
+
+//
+// Scalar kernels
+//
+
+static void copy_row(row_converter const& conv, uint8_t const* src, uint8_t* dst, size_t width)
+{
+	memcpy(dst, src, row_size(conv.from, width));
+}
+
+static void rgb_to_rgb(row_converter const& conv, uint8_t const* src, uint8_t* dst, size_t width)
+{
+	pixel_channels const s = conv.src, d = conv.dst;
+	for (size_t x = 0; x < width; ++x, src += s.size, dst += d.size)
+	{
+		uint8_t const r = src[s.r], g = src[s.g], b = src[s.b];
+		dst[d.r] = r;
+		dst[d.g] = g;
+		dst[d.b] = b;
+		if (d.a != pixel_channels::NONE)
+		{
+			dst[d.a] = (s.a != pixel_channels::NONE? src[s.a] : conv.alpha);
+		}
+	}
+}
+
+static void rgb_to_a8(row_converter const& conv, uint8_t const* src, uint8_t* dst, size_t width)
+{
+	pixel_channels const s = conv.src;
+	if (s.a == pixel_channels::NONE)
+	{
+		memset(dst, conv.alpha, width);
+		return;
+	}
+	for (size_t x = 0; x < width; ++x, src += s.size)
+	{
+		dst[x] = src[s.a];
+	}
+}
+
+static void a8_to_rgb(row_converter const& conv, uint8_t const* src, uint8_t* dst, size_t width)
+{
+	pixel_channels const d = conv.dst;
+	for (size_t x = 0; x < width; ++x, dst += d.size)
+	{
+		dst[d.r] = dst[d.g] = dst[d.b] = src[x];
+		if (d.a != pixel_channels::NONE)
+		{
+			dst[d.a] = conv.alpha;
+		}
+	}
+}
+
+static void uyvy_to_rgb(row_converter const& conv, uint8_t const* src, uint8_t* dst, size_t width)
+{
+	pixel_channels const d = conv.dst;
+	for (size_t x = 0; x < width; x += 2, src += 4)
+	{
+		int32_t const u = src[0] - 128, v = src[2] - 128;
+		int32_t const r = conv.rv * v + 32768;
+		int32_t const g = conv.gu * u + conv.gv * v + 32768;
+		int32_t const b = conv.bu * u + 32768;
+
+		for (size_t i = 0; i < 2 && x + i < width; ++i, dst += d.size)
+		{
+			int32_t const y = conv.y * (src[1 + 2 * i] - 16);
+			dst[d.r] = clamp8((y + r) >> 16);
+			dst[d.g] = clamp8((y + g) >> 16);
+			dst[d.b] = clamp8((y + b) >> 16);
+			if (d.a != pixel_channels::NONE)
+			{
+				dst[d.a] = conv.alpha;
+			}
+		}
+	}
+}
+
+static void rgb_to_uyvy(row_converter const& conv, uint8_t const* src, uint8_t* dst, size_t width)
+{
+	pixel_channels const s = conv.src;
+	int32_t const y_offset = (16 << 16) + 32768, uv_offset = (128 << 16) + 32768;
+	for (size_t x = 0; x < width; x += 2, dst += 4)
+	{
+		// the last pixel of odd width row is paired with itself
+		uint8_t const* p0 = src + x * s.size;
+		uint8_t const* p1 = (x + 1 < width? p0 + s.size : p0);
+
+		int32_t const r0 = p0[s.r], g0 = p0[s.g], b0 = p0[s.b];
+		int32_t const r1 = p1[s.r], g1 = p1[s.g], b1 = p1[s.b];
+		int32_t const r = r0 + r1, g = g0 + g1, b = b0 + b1;
+
+		dst[0] = clamp8((conv.ur * r + conv.ug * g + conv.ub * b + 2 * uv_offset) >> 17);
+		dst[1] = clamp8((conv.yr * r0 + conv.yg * g0 + conv.yb * b0 + y_offset) >> 16);
+		dst[2] = clamp8((conv.vr * r + conv.vg * g + conv.vb * b + 2 * uv_offset) >> 17);
+		dst[3] = clamp8((conv.yr * r1 + conv.yg * g1 + conv.yb * b1 + y_offset) >> 16);
+	}
+}
+
+static inline uint32_t read_le32(uint8_t const* p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+static inline void write_le32(uint8_t* p, uint32_t v)
+{
+	p[0] = static_cast<uint8_t>(v);
+	p[1] = static_cast<uint8_t>(v >> 8);
+	p[2] = static_cast<uint8_t>(v >> 16);
+	p[3] = static_cast<uint8_t>(v >> 24);
+}
+
+// v210 stores 10-bit samples in UYVY order, three in each 32-bit word
+static void v210_to_uyvy(row_converter const&, uint8_t const* src, uint8_t* dst, size_t width)
+{
+	size_t const samples = (width + 1) / 2 * 4;
+	for (size_t i = 0; i < samples; i += 3, src += 4)
+	{
+		uint32_t const w = read_le32(src);
+		for (size_t k = 0; k < 3 && i + k < samples; ++k)
+		{
+			*dst++ = static_cast<uint8_t>((w >> (10 * k + 2)) & 0xFF);
+		}
+	}
+}
+
+static void uyvy_to_v210(row_converter const&, uint8_t const* src, uint8_t* dst, size_t width)
+{
+	size_t const samples = (width + 1) / 2 * 4;
+	size_t const words = (width + 5) / 6 * 4;
+	for (size_t i = 0, n = 0; n < words; i += 3, ++n, dst += 4)
+	{
+		uint32_t w = 0;
+		for (size_t k = 0; k < 3 && i + k < samples; ++k)
+		{
+			uint32_t const v = src[i + k];
+			w |= ((v << 2) | (v >> 6)) << (10 * k);
+		}
+		write_le32(dst, w);
+	}
+}
+
+// r210 is big-endian 32-bit word with 10-bit R, G, B in bits 29-20, 19-10, 9-0
+static void r210_to_rgb(row_converter const& conv, uint8_t const* src, uint8_t* dst, size_t width)
+{
+	pixel_channels const d = conv.dst;
+	for (size_t x = 0; x < width; ++x, src += 4, dst += d.size)
+	{
+		uint32_t const w = (static_cast<uint32_t>(src[0]) << 24) | (src[1] << 16) | (src[2] << 8) | src[3];
+		dst[d.r] = static_cast<uint8_t>(w >> 22);
+		dst[d.g] = static_cast<uint8_t>(w >> 12);
+		dst[d.b] = static_cast<uint8_t>(w >> 2);
+		if (d.a != pixel_channels::NONE)
+		{
+			dst[d.a] = conv.alpha;
+		}
+	}
+}
+
+static void rgb_to_r210(row_converter const& conv, uint8_t const* src, uint8_t* dst, size_t width)
+{
+	pixel_channels const s = conv.src;
+	for (size_t x = 0; x < width; ++x, src += s.size, dst += 4)
+	{
+		uint32_t const r = src[s.r], g = src[s.g], b = src[s.b];
+		uint32_t const w = (((r << 2) | (r >> 6)) << 20) | (((g << 2) | (g >> 6)) << 10) | ((b << 2) | (b >> 6));
+		dst[0] = static_cast<uint8_t>(w >> 24);
+		dst[1] = static_cast<uint8_t>(w >> 16);
+		dst[2] = static_cast<uint8_t>(w >> 8);
+		dst[3] = static_cast<uint8_t>(w);
+	}
+}
+
+//
+// SIMD kernels, process the main part of a row and leave the tail to scalar ones
+//
+
+#if IMAGE_CONVERT_X86
+
+IMAGE_TARGET("ssse3")
+static void ssse3_shuffle4(row_converter const& conv, uint8_t const* src, uint8_t* dst, size_t width)
+{
+	__m128i const mask = _mm_loadu_si128(reinterpret_cast<__m128i const*>(conv.mask));
+	size_t x = 0;
+	for (; x + 4 <= width; x += 4)
+	{
+		__m128i const p = _mm_loadu_si128(reinterpret_cast<__m128i const*>(src + x * 4));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x * 4), _mm_shuffle_epi8(p, mask));
+	}
+	rgb_to_rgb(conv, src + x * 4, dst + x * 4, width - x);
+}
+
+IMAGE_TARGET("avx2")
+static void avx2_shuffle4(row_converter const& conv, uint8_t const* src, uint8_t* dst, size_t width)
+{
+	__m256i const mask = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(conv.mask));
+	size_t x = 0;
+	for (; x + 8 <= width; x += 8)
+	{
+		__m256i const p = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(src + x * 4));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + x * 4), _mm256_shuffle_epi8(p, mask));
+	}
+	ssse3_shuffle4(conv, src + x * 4, dst + x * 4, width - x);
+}
+
+IMAGE_TARGET("ssse3")
+static void ssse3_rgb3_to_rgb4(row_converter const& conv, uint8_t const* src, uint8_t* dst, size_t width)
+{
+	__m128i const mask = _mm_loadu_si128(reinterpret_cast<__m128i const*>(conv.mask));
+	__m128i const fill = _mm_loadu_si128(reinterpret_cast<__m128i const*>(conv.fill));
+	size_t x = 0;
+	// 16 bytes are loaded for 4 pixels, stop before reading past the row end
+	for (; x + 6 <= width; x += 4)
+	{
+		__m128i const p = _mm_loadu_si128(reinterpret_cast<__m128i const*>(src + x * 3));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x * 4), _mm_or_si128(_mm_shuffle_epi8(p, mask), fill));
+	}
+	rgb_to_rgb(conv, src + x * 3, dst + x * 4, width - x);
+}
+
+IMAGE_TARGET("ssse3")
+static void ssse3_rgb4_to_rgb3(row_converter const& conv, uint8_t const* src, uint8_t* dst, size_t width)
+{
+	__m128i const mask = _mm_loadu_si128(reinterpret_cast<__m128i const*>(conv.mask));
+	size_t x = 0;
+	// 16 bytes are stored for 4 pixels, stop before writing past the row end
+	for (; x + 6 <= width; x += 4)
+	{
+		__m128i const p = _mm_loadu_si128(reinterpret_cast<__m128i const*>(src + x * 4));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x * 3), _mm_shuffle_epi8(p, mask));
+	}
+	rgb_to_rgb(conv, src + x * 4, dst + x * 3, width - x);
+}
+
+IMAGE_TARGET("ssse3")
+static void ssse3_rgb4_to_a8(row_converter const& conv, uint8_t const* src, uint8_t* dst, size_t width)
+{
+	// mask gathers alpha of 4 pixels into the lowest 4 bytes
+	__m128i const mask = _mm_loadu_si128(reinterpret_cast<__m128i const*>(conv.mask));
+	size_t x = 0;
+	for (; x + 16 <= width; x += 16)
+	{
+		__m128i const* p = reinterpret_cast<__m128i const*>(src + x * 4);
+		__m128i const a0 = _mm_shuffle_epi8(_mm_loadu_si128(p + 0), mask);
+		__m128i const a1 = _mm_slli_si128(_mm_shuffle_epi8(_mm_loadu_si128(p + 1), mask), 4);
+		__m128i const a2 = _mm_slli_si128(_mm_shuffle_epi8(_mm_loadu_si128(p + 2), mask), 8);
+		__m128i const a3 = _mm_slli_si128(_mm_shuffle_epi8(_mm_loadu_si128(p + 3), mask), 12);
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + x), _mm_or_si128(_mm_or_si128(a0, a1), _mm_or_si128(a2, a3)));
+	}
+	rgb_to_a8(conv, src + x * 4, dst + x, width - x);
+}
+
+// c * a for a in 1/64 units, with c = int + frac / 32768
+#define IMAGE_SSE_MUL(a, c) _mm_add_epi16(_mm_mullo_epi16(a, _mm_set1_epi16(conv.c##_int)), _mm_mulhrs_epi16(a, _mm_set1_epi16(conv.c##_frac)))
+#define IMAGE_AVX_MUL(a, c) _mm256_add_epi16(_mm256_mullo_epi16(a, _mm256_set1_epi16(conv.c##_int)), _mm256_mulhrs_epi16(a, _mm256_set1_epi16(conv.c##_frac)))
+
+IMAGE_TARGET("ssse3")
+static void ssse3_uyvy_to_rgb4(row_converter const& conv, uint8_t const* src, uint8_t* dst, size_t width)
+{
+	__m128i const y_mask = _mm_setr_epi8(1, -1, 3, -1, 5, -1, 7, -1, 9, -1, 11, -1, 13, -1, 15, -1);
+	__m128i const u_mask = _mm_setr_epi8(0, -1, 0, -1, 4, -1, 4, -1, 8, -1, 8, -1, 12, -1, 12, -1);
+	__m128i const v_mask = _mm_setr_epi8(2, -1, 2, -1, 6, -1, 6, -1, 10, -1, 10, -1, 14, -1, 14, -1);
+	__m128i const y_offset = _mm_set1_epi16(16);
+	__m128i const uv_offset = _mm_set1_epi16(128);
+	__m128i const round = _mm_set1_epi16(32);
+	__m128i const alpha = _mm_set1_epi8(static_cast<char>(conv.alpha));
+	// BGRA to destination order
+	__m128i const swizzle = _mm_loadu_si128(reinterpret_cast<__m128i const*>(conv.mask));
+
+	size_t x = 0;
+	for (; x + 8 <= width; x += 8)
+	{
+		__m128i const p = _mm_loadu_si128(reinterpret_cast<__m128i const*>(src + x * 2));
+
+		// 8 pixels with 6 fractional bits, saturation only happens out of the 0..255 range
+		__m128i const y = _mm_slli_epi16(_mm_sub_epi16(_mm_shuffle_epi8(p, y_mask), y_offset), 6);
+		__m128i const u = _mm_slli_epi16(_mm_sub_epi16(_mm_shuffle_epi8(p, u_mask), uv_offset), 6);
+		__m128i const v = _mm_slli_epi16(_mm_sub_epi16(_mm_shuffle_epi8(p, v_mask), uv_offset), 6);
+
+		__m128i const yy = _mm_adds_epi16(IMAGE_SSE_MUL(y, y), round);
+		__m128i const r = _mm_srai_epi16(_mm_adds_epi16(yy, IMAGE_SSE_MUL(v, rv)), 6);
+		__m128i const g = _mm_srai_epi16(_mm_adds_epi16(yy, _mm_adds_epi16(IMAGE_SSE_MUL(u, gu), IMAGE_SSE_MUL(v, gv))), 6);
+		__m128i const b = _mm_srai_epi16(_mm_adds_epi16(yy, IMAGE_SSE_MUL(u, bu)), 6);
+
+		__m128i const bg = _mm_unpacklo_epi8(_mm_packus_epi16(b, b), _mm_packus_epi16(g, g));
+		__m128i const ra = _mm_unpacklo_epi8(_mm_packus_epi16(r, r), alpha);
+		__m128i* out = reinterpret_cast<__m128i*>(dst + x * 4);
+		_mm_storeu_si128(out + 0, _mm_shuffle_epi8(_mm_unpacklo_epi16(bg, ra), swizzle));
+		_mm_storeu_si128(out + 1, _mm_shuffle_epi8(_mm_unpackhi_epi16(bg, ra), swizzle));
+	}
+	uyvy_to_rgb(conv, src + x * 2, dst + x * 4, width - x);
+}
+
+IMAGE_TARGET("avx2")
+static void avx2_uyvy_to_rgb4(row_converter const& conv, uint8_t const* src, uint8_t* dst, size_t width)
+{
+	__m256i const y_mask = _mm256_setr_epi8(1, -1, 3, -1, 5, -1, 7, -1, 9, -1, 11, -1, 13, -1, 15, -1,
+		1, -1, 3, -1, 5, -1, 7, -1, 9, -1, 11, -1, 13, -1, 15, -1);
+	__m256i const u_mask = _mm256_setr_epi8(0, -1, 0, -1, 4, -1, 4, -1, 8, -1, 8, -1, 12, -1, 12, -1,
+		0, -1, 0, -1, 4, -1, 4, -1, 8, -1, 8, -1, 12, -1, 12, -1);
+	__m256i const v_mask = _mm256_setr_epi8(2, -1, 2, -1, 6, -1, 6, -1, 10, -1, 10, -1, 14, -1, 14, -1,
+		2, -1, 2, -1, 6, -1, 6, -1, 10, -1, 10, -1, 14, -1, 14, -1);
+	__m256i const y_offset = _mm256_set1_epi16(16);
+	__m256i const uv_offset = _mm256_set1_epi16(128);
+	__m256i const round = _mm256_set1_epi16(32);
+	__m256i const alpha = _mm256_set1_epi8(static_cast<char>(conv.alpha));
+	__m256i const swizzle = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(conv.mask));
+
+	size_t x = 0;
+	for (; x + 16 <= width; x += 16)
+	{
+		__m256i const p = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(src + x * 2));
+
+		__m256i const y = _mm256_slli_epi16(_mm256_sub_epi16(_mm256_shuffle_epi8(p, y_mask), y_offset), 6);
+		__m256i const u = _mm256_slli_epi16(_mm256_sub_epi16(_mm256_shuffle_epi8(p, u_mask), uv_offset), 6);
+		__m256i const v = _mm256_slli_epi16(_mm256_sub_epi16(_mm256_shuffle_epi8(p, v_mask), uv_offset), 6);
+
+		__m256i const yy = _mm256_adds_epi16(IMAGE_AVX_MUL(y, y), round);
+		__m256i const r = _mm256_srai_epi16(_mm256_adds_epi16(yy, IMAGE_AVX_MUL(v, rv)), 6);
+		__m256i const g = _mm256_srai_epi16(_mm256_adds_epi16(yy, _mm256_adds_epi16(IMAGE_AVX_MUL(u, gu), IMAGE_AVX_MUL(v, gv))), 6);
+		__m256i const b = _mm256_srai_epi16(_mm256_adds_epi16(yy, IMAGE_AVX_MUL(u, bu)), 6);
+
+		// in-lane unpacking gives pixels 0-3, 8-11 and 4-7, 12-15
+		__m256i const bg = _mm256_unpacklo_epi8(_mm256_packus_epi16(b, b), _mm256_packus_epi16(g, g));
+		__m256i const ra = _mm256_unpacklo_epi8(_mm256_packus_epi16(r, r), alpha);
+		__m256i const lo = _mm256_shuffle_epi8(_mm256_unpacklo_epi16(bg, ra), swizzle);
+		__m256i const hi = _mm256_shuffle_epi8(_mm256_unpackhi_epi16(bg, ra), swizzle);
+		__m256i* out = reinterpret_cast<__m256i*>(dst + x * 4);
+		_mm256_storeu_si256(out + 0, _mm256_permute2x128_si256(lo, hi, 0x20));
+		_mm256_storeu_si256(out + 1, _mm256_permute2x128_si256(lo, hi, 0x31));
+	}
+	ssse3_uyvy_to_rgb4(conv, src + x * 2, dst + x * 4, width - x);
+}
+
+#undef IMAGE_SSE_MUL
+#undef IMAGE_AVX_MUL
+
+#endif // IMAGE_CONVERT_X86
+
+#if IMAGE_CONVERT_NEON
+
+static inline uint8x16_t neon_channel(uint8x16x4_t const& p, uint8_t pos, uint8_t alpha)
+{
+	switch (pos)
+	{
+	case 0:  return p.val[0];
+	case 1:  return p.val[1];
+	case 2:  return p.val[2];
+	case 3:  return p.val[3];
+	default: return vdupq_n_u8(alpha);
+	}
+}
+
+// RGB formats and A8 with structure loads and stores, 16 pixels at once
+static void neon_rgb_to_rgb(row_converter const& conv, uint8_t const* src, uint8_t* dst, size_t width)
+{
+	pixel_channels const s = conv.src, d = conv.dst;
+	size_t const dst_size = (conv.to == A8? 1 : d.size);
+	size_t x = 0;
+	for (; x + 16 <= width; x += 16)
+	{
+		uint8x16x4_t p;
+		if (s.size == 4)
+		{
+			p = vld4q_u8(src + x * 4);
+		}
+		else
+		{
+			uint8x16x3_t const p3 = vld3q_u8(src + x * 3);
+			p.val[0] = p3.val[0];
+			p.val[1] = p3.val[1];
+			p.val[2] = p3.val[2];
+			p.val[3] = vdupq_n_u8(conv.alpha);
+		}
+		uint8x16_t const r = neon_channel(p, s.r, conv.alpha);
+		uint8x16_t const g = neon_channel(p, s.g, conv.alpha);
+		uint8x16_t const b = neon_channel(p, s.b, conv.alpha);
+		uint8x16_t const a = neon_channel(p, s.a, conv.alpha);
+
+		if (conv.to == A8)
+		{
+			vst1q_u8(dst + x, a);
+		}
+		else if (d.size == 4)
+		{
+			uint8x16x4_t q;
+			q.val[d.r] = r;
+			q.val[d.g] = g;
+			q.val[d.b] = b;
+			q.val[d.a] = a;
+			vst4q_u8(dst + x * 4, q);
+		}
+		else
+		{
+			uint8x16x3_t q;
+			q.val[d.r] = r;
+			q.val[d.g] = g;
+			q.val[d.b] = b;
+			vst3q_u8(dst + x * 3, q);
+		}
+	}
+	if (conv.to == A8)
+	{
+		rgb_to_a8(conv, src + x * s.size, dst + x, width - x);
+	}
+	else
+	{
+		rgb_to_rgb(conv, src + x * s.size, dst + x * dst_size, width - x);
+	}
+}
+
+#endif // IMAGE_CONVERT_NEON
+
+static simd_level detect_simd_level()
+{
+#if IMAGE_CONVERT_X86
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 1);
+	bool const ssse3 = (info[2] & (1 << 9)) != 0;
+	bool const avx = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6;
+	__cpuidex(info, 7, 0);
+	bool const avx2 = avx && (info[1] & (1 << 5));
+	return avx2? SIMD_AVX2 : ssse3? SIMD_SSSE3 : SIMD_NONE;
+#else
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) return SIMD_AVX2;
+	if (__builtin_cpu_supports("ssse3")) return SIMD_SSSE3;
+	return SIMD_NONE;
+#endif
+#elif IMAGE_CONVERT_NEON
+	return SIMD_NEON;
+#else
+	return SIMD_NONE;
+#endif
+}
+
+simd_level convert_simd_level()
+{
+	static simd_level const level = detect_simd_level();
+	return level;
+}
+
+simd_level convert_simd_level(simd_level max_simd)
+{
+	simd_level const level = convert_simd_level();
+	if (level == SIMD_NEON)
+	{
+		return max_simd == SIMD_NONE? SIMD_NONE : SIMD_NEON;
+	}
+	return max_simd == SIMD_NEON? level : std::min(level, max_simd);
+}
+
+static bool is_rgb(encoding format)
+{
+	pixel_channels ch;
+	return get_channels(format, ch);
+}
+
+// Set up a converter for formats with a direct kernel, false if there is no one
+static bool make_row_converter(encoding from, encoding to, convert_options const& options, row_converter& conv)
+{
+	conv = row_converter();
+	conv.from = from;
+	conv.to = to;
+	conv.alpha = options.alpha;
+	get_channels(from, conv.src);
+	get_channels(to, conv.dst);
+
+	yuv_coefficients const& k = (options.colorspace == BT601? bt601 : bt709);
+	conv.y = fixed16(k.y); conv.rv = fixed16(k.rv); conv.gu = fixed16(k.gu); conv.gv = fixed16(k.gv); conv.bu = fixed16(k.bu);
+	conv.yr = fixed16(k.yr); conv.yg = fixed16(k.yg); conv.yb = fixed16(k.yb);
+	conv.ur = fixed16(k.ur); conv.ug = fixed16(k.ug); conv.ub = fixed16(k.ub);
+	conv.vr = fixed16(k.vr); conv.vg = fixed16(k.vg); conv.vb = fixed16(k.vb);
+
+	struct split
+	{
+		static void apply(double c, int16_t& int_part, int16_t& frac_part)
+		{
+			double const i = (c >= 1? std::floor(c) : 0);
+			int_part = static_cast<int16_t>(i);
+			frac_part = static_cast<int16_t>(std::floor((c - i) * 32768 + 0.5));
+		}
+	};
+	split::apply(k.y, conv.y_int, conv.y_frac);
+	split::apply(k.rv, conv.rv_int, conv.rv_frac);
+	split::apply(k.gu, conv.gu_int, conv.gu_frac);
+	split::apply(k.gv, conv.gv_int, conv.gv_frac);
+	split::apply(k.bu, conv.bu_int, conv.bu_frac);
+
+	simd_level const simd = convert_simd_level(options.max_simd);
+
+	if (from == to)
+	{
+		conv.function = copy_row;
+	}
+	else if (is_rgb(from) && is_rgb(to))
+	{
+		conv.function = rgb_to_rgb;
+
+		// shuffle masks for 4 pixels, 0x80 clears a byte
+		pixel_channels const s = conv.src, d = conv.dst;
+		memset(conv.mask, 0x80, sizeof(conv.mask));
+		memset(conv.fill, 0, sizeof(conv.fill));
+		for (uint8_t p = 0; p < 4; ++p)
+		{
+			uint8_t* m = conv.mask + p * d.size;
+			m[d.r] = p * s.size + s.r;
+			m[d.g] = p * s.size + s.g;
+			m[d.b] = p * s.size + s.b;
+			if (d.a != pixel_channels::NONE)
+			{
+				if (s.a != pixel_channels::NONE)
+				{
+					m[d.a] = p * s.size + s.a;
+				}
+				else
+				{
+					conv.fill[p * d.size + d.a] = conv.alpha;
+				}
+			}
+		}
+		memcpy(conv.mask + 16, conv.mask, 16);
+		memcpy(conv.fill + 16, conv.fill, 16);
+
+#if IMAGE_CONVERT_X86
+		if (s.size == 4 && d.size == 4)
+		{
+			conv.function = (simd >= SIMD_AVX2? avx2_shuffle4 : simd >= SIMD_SSSE3? ssse3_shuffle4 : rgb_to_rgb);
+		}
+		else if (simd >= SIMD_SSSE3)
+		{
+			conv.function = (s.size == 3? ssse3_rgb3_to_rgb4 : ssse3_rgb4_to_rgb3);
+		}
+#elif IMAGE_CONVERT_NEON
+		if (simd == SIMD_NEON)
+		{
+			conv.function = neon_rgb_to_rgb;
+		}
+#endif
+	}
+	else if (is_rgb(from) && to == A8)
+	{
+		conv.function = rgb_to_a8;
+
+		memset(conv.mask, 0x80, sizeof(conv.mask));
+		if (conv.src.a != pixel_channels::NONE && conv.src.size == 4)
+		{
+			for (uint8_t p = 0; p < 4; ++p)
+			{
+				conv.mask[p] = p * 4 + conv.src.a;
+			}
+#if IMAGE_CONVERT_X86
+			if (simd >= SIMD_SSSE3)
+			{
+				conv.function = ssse3_rgb4_to_a8;
+			}
+#endif
+		}
+#if IMAGE_CONVERT_NEON
+		if (simd == SIMD_NEON && conv.src.a != pixel_channels::NONE)
+		{
+			conv.function = neon_rgb_to_rgb;
+		}
+#endif
+	}
+	else if (from == A8 && is_rgb(to))
+	{
+		conv.function = a8_to_rgb;
+	}
+	else if (from == YUV8 && is_rgb(to))
+	{
+		conv.function = uyvy_to_rgb;
+
+#if IMAGE_CONVERT_X86
+		if (conv.dst.size == 4 && simd >= SIMD_SSSE3)
+		{
+			// kernel output is BGRA, swizzle it to the destination order
+			pixel_channels bgra;
+			get_channels(BGRA8, bgra);
+			for (uint8_t p = 0; p < 4; ++p)
+			{
+				uint8_t* m = conv.mask + p * 4;
+				m[conv.dst.r] = p * 4 + bgra.r;
+				m[conv.dst.g] = p * 4 + bgra.g;
+				m[conv.dst.b] = p * 4 + bgra.b;
+				m[conv.dst.a] = p * 4 + bgra.a;
+			}
+			memcpy(conv.mask + 16, conv.mask, 16);
+			conv.function = (simd >= SIMD_AVX2? avx2_uyvy_to_rgb4 : ssse3_uyvy_to_rgb4);
+		}
+#endif
+	}
+	else if (is_rgb(from) && to == YUV8)
+	{
+		conv.function = rgb_to_uyvy;
+	}
+	else if (from == YUV10 && to == YUV8)
+	{
+		conv.function = v210_to_uyvy;
+	}
+	else if (from == YUV8 && to == YUV10)
+	{
+		conv.function = uyvy_to_v210;
+	}
+	else if (from == RGB10 && is_rgb(to))
+	{
+		conv.function = r210_to_rgb;
+	}
+	else if (is_rgb(from) && to == RGB10)
+	{
+		conv.function = rgb_to_r210;
+	}
+	else
+	{
+		return false;
+	}
+	return true;
+}
+
+// Formats with a direct row kernel in make_row_converter()
+static bool has_row_kernel(encoding from, encoding to)
+{
+	return from == to
+		|| (is_rgb(from) && (is_rgb(to) || to == A8 || to == YUV8 || to == RGB10))
+		|| (is_rgb(to) && (from == A8 || from == YUV8 || from == RGB10))
+		|| (from == YUV8 && to == YUV10)
+		|| (from == YUV10 && to == YUV8);
+}
+
+static encoding const convertible[] = { BGRA8, RGBA8, ARGB8, RGB8, A8, YUV8, YUV10, RGB10 };
+static size_t const convertible_count = sizeof(convertible) / sizeof(convertible[0]);
+
+// Shortest chain of direct conversions, empty if there is no one
+static std::vector<encoding> conversion_path(encoding from, encoding to)
+{
+	// breadth first search over the direct conversions
+	std::vector<std::vector<encoding>> paths(1, std::vector<encoding>(1, from));
+	for (size_t i = 0; i < paths.size(); ++i)
+	{
+		std::vector<encoding> const path = paths[i];
+		if (path.back() == to)
+		{
+			return path;
+		}
+		for (size_t k = 0; k < convertible_count && path.size() < 4; ++k)
+		{
+			encoding const next = convertible[k];
+			if (std::find(path.begin(), path.end(), next) == path.end()
+				&& has_row_kernel(path.back(), next))
+			{
+				paths.push_back(path);
+				paths.back().push_back(next);
+			}
+		}
+	}
+	return std::vector<encoding>();
+}
+
+static bool is_planar(encoding format)
+{
+	return bitmap::plane_count(format) > 1;
+}
+
+// Planar formats are converted through UYVY rows
+static encoding packed_format(encoding format)
+{
+	return is_planar(format)? YUV8 : format;
+}
+
+bool can_convert(encoding from, encoding to)
+{
+	return !conversion_path(packed_format(from), packed_format(to)).empty();
+}
+
+static std::vector<row_converter> make_steps(encoding from, encoding to, convert_options const& options)
+{
+	std::vector<encoding> const path = conversion_path(from, to);
+	std::vector<row_converter> steps(path.size() > 1? path.size() - 1 : 0);
+	for (size_t i = 0; i < steps.size(); ++i)
+	{
+		make_row_converter(path[i], path[i + 1], options, steps[i]);
+	}
+	return steps;
+}
+
+// Intermediate rows for multi-step conversions
+struct row_buffers
+{
+	buffer temp[2];
+
+	row_buffers(std::vector<row_converter> const& steps, size_t width)
+	{
+		for (size_t i = 0; i + 1 < steps.size(); ++i)
+		{
+			temp[i % 2].resize(row_size(steps[i].to, width) + 32);
+		}
+	}
+
+	void run(std::vector<row_converter> const& steps, uint8_t const* in, uint8_t* out, size_t width)
+	{
+		for (size_t i = 0; i < steps.size(); ++i)
+		{
+			uint8_t* step_out = (i + 1 == steps.size()? out : temp[i % 2].data());
+			steps[i](in, step_out, width);
+			in = step_out;
+		}
+	}
+};
+
+// Call convert_band(y_begin, y_end) for bands of rows on worker threads for large images,
+// band boundaries are multiples of row_align
+template<typename Function>
+static void for_each_band(image_size const& size, size_t row_align, convert_options const& options, Function convert_band)
+{
+	size_t const width = size.width;
+	size_t const height = size.height;
+
+	size_t const min_pixels_per_thread = 256 * 1024;
+	size_t threads = options.max_threads? options.max_threads : boost::thread::hardware_concurrency();
+	threads = std::max<size_t>(1, std::min(threads, std::min(width * height / min_pixels_per_thread, height / row_align)));
+
+	size_t const band = ((height + threads - 1) / threads + row_align - 1) / row_align * row_align;
+	if (threads > 1)
+	{
+		boost::thread_group workers;
+		for (size_t t = 1; t < threads; ++t)
+		{
+			size_t const y_begin = std::min(height, t * band);
+			size_t const y_end = std::min(height, y_begin + band);
+			workers.create_thread([&convert_band, y_begin, y_end]() { convert_band(y_begin, y_end); });
+		}
+		convert_band(0, std::min(height, band));
+		workers.join_all();
+	}
+	else
+	{
+		convert_band(0, height);
+	}
+}
+
+bool convert(uint8_t const* src, size_t src_stride, encoding src_format,
+	uint8_t* dst, size_t dst_stride, encoding dst_format, image_size const& size,
+	convert_options const& options)
+{
+	if (!src || !dst || size.width <= 0 || size.height <= 0 || is_planar(src_format) || is_planar(dst_format))
+	{
+		return false;
+	}
+	if (!can_convert(src_format, dst_format))
+	{
+		return false;
+	}
+
+	std::vector<row_converter> steps = make_steps(src_format, dst_format, options);
+	if (steps.empty())
+	{
+		steps.resize(1);
+		make_row_converter(src_format, dst_format, options, steps[0]);
+	}
+
+	size_t const width = size.width;
+	for_each_band(size, 1, options, [&steps, src, src_stride, dst, dst_stride, width](size_t y_begin, size_t y_end)
+		{
+			row_buffers rows(steps, width);
+			for (size_t y = y_begin; y < y_end; ++y)
+			{
+				rows.run(steps, src + y * src_stride, dst + y * dst_stride, width);
+			}
+		});
+	return true;
+}
+
+// Row y of planar 4:2:0 bitmap to UYVY
+static void planar_to_uyvy(bitmap const& src, size_t y, uint8_t* dst)
+{
+	size_t const width = src.size().width;
+	size_t const pairs = (width + 1) / 2;
+	size_t const last = width - 1;
+
+	uint8_t const* luma = src.plane_data(0) + y * src.plane(0).stride;
+	uint8_t const* chroma = src.plane_data(1) + y / 2 * src.plane(1).stride;
+
+	switch (src.pixel_format())
+	{
+	case I420:
+		{
+			uint8_t const* v = src.plane_data(2) + y / 2 * src.plane(2).stride;
+			for (size_t i = 0; i < pairs; ++i, dst += 4)
+			{
+				dst[0] = chroma[i];
+				dst[1] = luma[2 * i];
+				dst[2] = v[i];
+				dst[3] = luma[std::min(2 * i + 1, last)];
+			}
+		}
+		break;
+	case NV12:
+		for (size_t i = 0; i < pairs; ++i, dst += 4)
+		{
+			dst[0] = chroma[2 * i];
+			dst[1] = luma[2 * i];
+			dst[2] = chroma[2 * i + 1];
+			dst[3] = luma[std::min(2 * i + 1, last)];
+		}
+		break;
+	case P010:
+		// high byte of little-endian 16-bit samples
+		for (size_t i = 0; i < pairs; ++i, dst += 4)
+		{
+			dst[0] = chroma[4 * i + 1];
+			dst[1] = luma[4 * i + 1];
+			dst[2] = chroma[4 * i + 3];
+			dst[3] = luma[std::min(2 * i + 1, last) * 2 + 1];
+		}
+		break;
+	default:
+		_aspect_assert(false && "not a planar format");
+		break;
+	}
+}
+
+// UYVY rows y and y + 1 to planar 4:2:0, chroma is averaged vertically
+static void uyvy_to_planar(uint8_t const* row0, uint8_t const* row1, bitmap& dst, size_t y)
+{
+	size_t const width = dst.size().width;
+	size_t const pairs = (width + 1) / 2;
+	bool const has_row1 = (y + 1 < static_cast<size_t>(dst.size().height));
+
+	uint8_t* luma0 = dst.plane_data(0) + y * dst.plane(0).stride;
+	uint8_t* luma1 = luma0 + dst.plane(0).stride;
+	uint8_t* chroma = dst.plane_data(1) + y / 2 * dst.plane(1).stride;
+
+	size_t const samples = (dst.pixel_format() == P010? 2 : 1);
+	auto put = [samples](uint8_t* p, size_t index, uint8_t v)
+	{
+		if (samples == 2)
+		{
+			// expand to 16 bits, 0xFF to 0xFFFF
+			p[index * 2] = v;
+			p[index * 2 + 1] = v;
+		}
+		else
+		{
+			p[index] = v;
+		}
+	};
+
+	for (size_t x = 0; x < width; ++x)
+	{
+		put(luma0, x, row0[x / 2 * 4 + 1 + (x & 1) * 2]);
+		if (has_row1)
+		{
+			put(luma1, x, row1[x / 2 * 4 + 1 + (x & 1) * 2]);
+		}
+	}
+
+	uint8_t* v_plane = (dst.pixel_format() == I420? dst.plane_data(2) + y / 2 * dst.plane(2).stride : nullptr);
+	for (size_t i = 0; i < pairs; ++i)
+	{
+		uint8_t const u = static_cast<uint8_t>((row0[4 * i] + row1[4 * i] + 1) / 2);
+		uint8_t const v = static_cast<uint8_t>((row0[4 * i + 2] + row1[4 * i + 2] + 1) / 2);
+		if (v_plane)
+		{
+			chroma[i] = u;
+			v_plane[i] = v;
+		}
+		else
+		{
+			put(chroma, 2 * i, u);
+			put(chroma, 2 * i + 1, v);
+		}
+	}
+}
+
+// Conversion with a planar source or destination through UYVY rows
+static bool convert_planar(bitmap const& src, bitmap& dst, convert_options const& options)
+{
+	encoding const src_format = packed_format(src.pixel_format());
+	encoding const dst_format = packed_format(dst.pixel_format());
+	std::vector<row_converter> const steps = make_steps(src_format, dst_format, options);
+
+	bool const src_planar = src.is_planar();
+	bool const dst_planar = dst.is_planar();
+	size_t const width = src.size().width;
+	size_t const height = src.size().height;
+	size_t const uyvy_size = row_size(YUV8, width) + 32;
+
+	for_each_band(src.size(), 2, options, [&](size_t y_begin, size_t y_end)
+		{
+			row_buffers rows(steps, width);
+			buffer src_row(src_planar? uyvy_size : 0);
+			buffer dst_rows[2];
+			if (dst_planar)
+			{
+				dst_rows[0].resize(uyvy_size);
+				dst_rows[1].resize(uyvy_size);
+			}
+
+			// convert source row y into out, a destination row or UYVY row for planar destination
+			auto convert_row = [&](size_t y, uint8_t* out)
+			{
+				uint8_t const* in = src.data() + y * src.stride();
+				if (src_planar)
+				{
+					planar_to_uyvy(src, y, src_row.data());
+					in = src_row.data();
+				}
+				if (steps.empty())
+				{
+					memcpy(out, in, row_size(dst_format, width));
+				}
+				else
+				{
+					rows.run(steps, in, out, width);
+				}
+			};
+
+			for (size_t y = y_begin; y < y_end; y += (dst_planar? 2 : 1))
+			{
+				if (dst_planar)
+				{
+					convert_row(y, dst_rows[0].data());
+					convert_row(std::min(y + 1, height - 1), dst_rows[1].data());
+					uyvy_to_planar(dst_rows[0].data(), dst_rows[1].data(), dst, y);
+				}
+				else
+				{
+					convert_row(y, dst.data() + y * dst.stride());
+				}
+			}
+		});
+	return true;
+}
+
+bool convert(bitmap const& src, bitmap& dst, convert_options const& options)
+{
+	if (!can_convert(src.pixel_format(), dst.pixel_format()) || !src.data())
+	{
+		return false;
+	}
+	dst.resize(src.size());
+
+	if (src.is_planar() || dst.is_planar())
+	{
+		return convert_planar(src, dst, options);
+	}
+	return convert(src.data(), src.stride(), src.pixel_format(),
+		dst.data(), dst.stride(), dst.pixel_format(), src.size(), options);
+}
+
+}} // aspect::image
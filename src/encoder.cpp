@@ -36,6 +36,7 @@ inline int libpng_color_type(png_color_type color_type)
 	switch (color_type)
 	{
 	case png_color_type::palette:
+	case png_color_type::palette_rgba:
 		return PNG_COLOR_TYPE_PALETTE;
 	case png_color_type::rgb:
 		return PNG_COLOR_TYPE_RGB;
@@ -47,6 +48,12 @@ inline int libpng_color_type(png_color_type color_type)
 	}
 }
 
+// smallest bit depth for palette indices, libpng packs them with png_set_packing()
+inline int palette_bit_depth(size_t lut_size)
+{
+	return lut_size <= 2? 1 : (lut_size <= 4? 2 : (lut_size <= 16? 4 : 8));
+}
+
 // -- callbacks
 inline void png_write_file(png_struct* png, png_byte* data, png_size_t size)
 {
@@ -62,13 +69,14 @@ inline void png_flush_file(png_struct*)
 	// do nothing - used for flushing file i/o
 }
 
-std::string generate_png(bitmap const& image, buffer& result, image_rect rect,
-	bool flip, int compression, png_color_type color_type)
+// quantizer is used only for the palette color type
+static std::string write_png(bitmap const& image, buffer& result, image_rect rect,
+	bool flip, int compression, png_color_type color_type, quantizer* quantizer)
 {
 	rect = clamped_rect(image, rect);
 
-	uint8_t const* pixels = image.data();
-	size_t stride = rect.width * image.bytes_per_pixel();
+	uint8_t const* const pixels = image.data();
+	size_t const stride = image.stride();
 	size_t const bytes_per_pixel = image.bytes_per_pixel();
 
 	png_struct* png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
@@ -86,7 +94,16 @@ std::string generate_png(bitmap const& image, buffer& result, image_rect rect,
 
 	png_set_compression_level(png, compression);
 
-	png_set_IHDR(png, info, rect.width, rect.height, 8, libpng_color_type(color_type),
+	bool const palette = (color_type == png_color_type::palette || color_type == png_color_type::palette_rgba);
+	int bit_depth = 8;
+	if (palette)
+	{
+		_aspect_assert(quantizer);
+		quantizer->build_palette(pixels, stride, rect, 0xff, image.pixel_format());
+		bit_depth = palette_bit_depth(quantizer->lut_size());
+	}
+
+	png_set_IHDR(png, info, rect.width, rect.height, bit_depth, libpng_color_type(color_type),
 		PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
 	png_write_info_before_PLTE(png, info);
 
@@ -117,18 +134,29 @@ std::string generate_png(bitmap const& image, buffer& result, image_rect rect,
 	int y_end = rect.bottom();
 	int dy = 1;
 
-	aspect::image::quantizer quantizer;
-	if (color_type == png_color_type::palette)
+	if (palette)
 	{
-		quantizer.quantize(pixels, stride, rect, 0xff);
-		png_set_PLTE(png, info, (png_color*)quantizer.lut24(), 0xff);
-
-		// quantizer generates index data already in the desired resolution, just store it
-		x = 0;
-		y = 0;
-		y_end = rect.height;
-		pixels = quantizer.result_data();
-		stride = rect.width;
+		png_set_PLTE(png, info, (png_color*)quantizer->lut24(), static_cast<int>(quantizer->lut_size()));
+
+		if (quantizer->alpha())
+		{
+			// inverted alpha as in png_set_invert_alpha() for rgba, palette
+			// is ordered by decreasing stored alpha, so trailing opaque
+			// entries with stored alpha 0 are omitted from tRNS
+			struct rgba { uint8_t r, g, b, a; };
+			rgba const* lut = reinterpret_cast<rgba const*>(quantizer->lut32());
+			png_byte trans[quantizer::max_lut_size];
+			size_t num_trans = 0;
+			for (size_t i = 0; i < quantizer->lut_size(); ++i)
+			{
+				trans[i] = 255 - lut[i].a;
+				if (trans[i] != 255) num_trans = i + 1;
+			}
+			if (num_trans > 0)
+			{
+				png_set_tRNS(png, info, trans, static_cast<int>(num_trans), NULL);
+			}
+		}
 	}
 
 	if (flip)
@@ -139,21 +167,195 @@ std::string generate_png(bitmap const& image, buffer& result, image_rect rect,
 	}
 
 	png_write_info(png, info);
-	for (; y != y_end; y += dy)
+	if (palette)
+	{
+		// map source rows to palette indices on the fly
+		buffer row(rect.width);
+		quantizer->begin_map(rect.width, image.pixel_format());
+		for (; y != y_end; y += dy)
+		{
+			quantizer->map_row(&pixels[(y * stride) + x], &row[0]);
+			png_write_row(png, &row[0]);
+		}
+	}
+	else
 	{
-		png_write_row(png, &pixels[(y * stride) + x]);
+		for (; y != y_end; y += dy)
+		{
+			png_write_row(png, &pixels[(y * stride) + x]);
+		}
 	}
 	png_write_end(png, NULL);
 
 	return "image/png";
 }
 
+std::string generate_png(bitmap const& image, buffer& result, image_rect rect,
+	bool flip, int compression, png_color_type color_type)
+{
+	if (color_type == png_color_type::palette || color_type == png_color_type::palette_rgba)
+	{
+		aspect::image::quantizer quantizer;
+		quantizer.set_alpha(color_type == png_color_type::palette_rgba);
+		return write_png(image, result, rect, flip, compression, color_type, &quantizer);
+	}
+	return write_png(image, result, rect, flip, compression, color_type, nullptr);
+}
+
+std::string generate_png(bitmap const& image, buffer& result, image_rect rect,
+	quantizer& quantizer, bool flip, int compression)
+{
+	return write_png(image, result, rect, flip, compression, png_color_type::palette, &quantizer);
+}
+
+// Compress planar 4:2:0 image with raw data, without color conversion and downsampling
+static std::string generate_jpeg_yuv420(bitmap const& image, buffer& result, image_rect rect, bool flip, int quality)
+{
+	using boost::algorithm::clamp;
+
+	// chroma samples are shared by 2x2 pixels, align rect origin to them
+	// widening the rect to keep its right and bottom edges
+	int const right = clamp(rect.left + rect.width, 0, image.size().width);
+	int const bottom = clamp(rect.top + rect.height, 0, image.size().height);
+	int const left = clamp(rect.left, 0, image.size().width) & ~1;
+	int const top = clamp(rect.top, 0, image.size().height) & ~1;
+	rect = image_rect(left, top, std::max(right - left, 0), std::max(bottom - top, 0));
+	_aspect_assert(image.data() && !rect.is_empty());
+
+	// video limited range to JPEG full range
+	uint8_t luma_range[256], chroma_range[256];
+	for (int v = 0; v < 256; ++v)
+	{
+		luma_range[v] = static_cast<uint8_t>(clamp(((v - 16) * 255 + 109) / 219, 0, 255));
+		chroma_range[v] = static_cast<uint8_t>(clamp(128 + ((v - 128) * 255 + (v < 128? -112 : 112)) / 224, 0, 255));
+	}
+
+	jpeg_compress_struct cinfo;
+	jpeg_error_mgr jerr;
+	unsigned char* buf_data = NULL;
+	unsigned long  buf_size = 0;
+
+	BOOST_SCOPE_EXIT(&cinfo, &buf_data)
+	{
+		jpeg_destroy_compress(&cinfo);
+		free(buf_data);
+	}
+	BOOST_SCOPE_EXIT_END
+
+	cinfo.err = jpeg_std_error(&jerr);
+	jpeg_create_compress(&cinfo);
+	jpeg_mem_dest(&cinfo, &buf_data, &buf_size);
+
+	cinfo.image_width			= rect.width;
+	cinfo.image_height			= rect.height;
+	cinfo.input_components		= 3;
+	cinfo.in_color_space		= JCS_YCbCr;
+
+	jpeg_set_defaults(&cinfo);
+	jpeg_set_quality(&cinfo, quality, TRUE /* limit to baseline-JPEG values */);
+
+	cinfo.raw_data_in = TRUE;
+	cinfo.comp_info[0].h_samp_factor = 2;
+	cinfo.comp_info[0].v_samp_factor = 2;
+	for (int c = 1; c < 3; ++c)
+	{
+		cinfo.comp_info[c].h_samp_factor = 1;
+		cinfo.comp_info[c].v_samp_factor = 1;
+	}
+
+	jpeg_start_compress(&cinfo, TRUE);
+
+	// raw data is written by 16 luma and 8 chroma rows padded to DCT blocks
+	size_t const luma_width = (rect.width + 15) & ~15;
+	size_t const chroma_width = luma_width / 2;
+	buffer planes(luma_width * 16 + chroma_width * 8 * 2);
+	JSAMPROW luma_rows[16], cb_rows[8], cr_rows[8];
+	for (size_t i = 0; i < 16; ++i)
+	{
+		luma_rows[i] = &planes[i * luma_width];
+	}
+	for (size_t i = 0; i < 8; ++i)
+	{
+		cb_rows[i] = &planes[luma_width * 16 + i * chroma_width];
+		cr_rows[i] = &planes[luma_width * 16 + (8 + i) * chroma_width];
+	}
+	JSAMPARRAY data[3] = { luma_rows, cb_rows, cr_rows };
+
+	encoding const format = image.pixel_format();
+	size_t const sample_size = (format == P010? 2 : 1);
+	size_t const high_byte = sample_size - 1; // 8 high bits of 16-bit samples
+	size_t const width = rect.width;
+	size_t const last_row = rect.height - 1;
+
+	for (size_t y = 0; y < static_cast<size_t>(rect.height); y += 16)
+	{
+		for (size_t i = 0; i < 16; ++i)
+		{
+			// repeat the last row and column to fill DCT blocks
+			size_t const row = std::min(y + i, last_row);
+			size_t const src_row = rect.top + (flip? last_row - row : row);
+
+			uint8_t const* luma = image.plane_data(0) + src_row * image.plane(0).stride + rect.left * sample_size;
+			uint8_t* out = luma_rows[i];
+			for (size_t x = 0; x < luma_width; ++x)
+			{
+				out[x] = luma_range[luma[std::min(x, width - 1) * sample_size + high_byte]];
+			}
+
+			if (i % 2 == 0)
+			{
+				uint8_t* cb = cb_rows[i / 2];
+				uint8_t* cr = cr_rows[i / 2];
+				size_t const chroma_row = src_row / 2;
+				size_t const chroma_left = rect.left / 2;
+				size_t const chroma_last = (width - 1) / 2;
+				if (format == I420)
+				{
+					uint8_t const* u = image.plane_data(1) + chroma_row * image.plane(1).stride + chroma_left;
+					uint8_t const* v = image.plane_data(2) + chroma_row * image.plane(2).stride + chroma_left;
+					for (size_t x = 0; x < chroma_width; ++x)
+					{
+						cb[x] = chroma_range[u[std::min(x, chroma_last)]];
+						cr[x] = chroma_range[v[std::min(x, chroma_last)]];
+					}
+				}
+				else
+				{
+					uint8_t const* uv = image.plane_data(1) + chroma_row * image.plane(1).stride + chroma_left * 2 * sample_size;
+					for (size_t x = 0; x < chroma_width; ++x)
+					{
+						size_t const pos = std::min(x, chroma_last) * 2 * sample_size + high_byte;
+						cb[x] = chroma_range[uv[pos]];
+						cr[x] = chroma_range[uv[pos + sample_size]];
+					}
+				}
+			}
+		}
+		jpeg_write_raw_data(&cinfo, data, 16);
+	}
+
+	jpeg_finish_compress(&cinfo);
+
+	result.resize(buf_size);
+	if (buf_size > 0)
+	{
+		memcpy(&result[0], buf_data, buf_size);
+	}
+
+	return "image/jpeg";
+}
+
 std::string generate_jpeg(bitmap const& image, buffer& result, image_rect rect, bool flip, int quality)
 {
+	if (image.is_planar())
+	{
+		return generate_jpeg_yuv420(image, result, rect, flip, quality);
+	}
+
 	rect = clamped_rect(image, rect);
 
 	uint8_t const* const pixels = image.data();
-	size_t const stride = rect.width * image.bytes_per_pixel();
+	size_t const stride = image.stride();
 	size_t const bytes_per_pixel = image.bytes_per_pixel();
 
 	jpeg_compress_struct cinfo;
@@ -219,8 +421,8 @@ std::string generate_jpeg(bitmap const& image, buffer& result, image_rect rect,
 	// more if you wish, though.
 	//
 	int const x = static_cast<int>(rect.left * bytes_per_pixel);
-	int y = 0;
-	int y_end = cinfo.image_height;
+	int y = rect.top;
+	int y_end = rect.bottom();
 	int dy = 1;
 	if (flip)
 	{
@@ -343,7 +545,8 @@ std::string generate_bmp(bitmap const& image, buffer& result, image_rect rect, b
 		red_mask, green_mask, blue_mask, with_alpha? alpha_mask : 0);
 
 	uint8_t const* pixels = image.data();
-	size_t const stride = rect.width * 4;
+	size_t const stride = image.stride();
+	size_t const row_size = rect.width * 4; // 32-bit BMP rows need no padding
 
 	int const x = rect.left * 4;
 	int y = rect.top;
@@ -358,8 +561,8 @@ std::string generate_bmp(bitmap const& image, buffer& result, image_rect rect, b
 	for (int iY = rect.height - 1; y != y_end; y += dy, --iY)
 	{
 		uint8_t const* src = &pixels[(y * stride) + x];
-		uint8_t* dst = &result[pixels_offset] + (iY * stride);
-		memcpy(dst, src, stride);
+		uint8_t* dst = &result[pixels_offset] + (iY * row_size);
+		memcpy(dst, src, row_size);
 	}
 
 	return "image/bmp";
@@ -0,0 +1,326 @@
+#include "image/frame_diff.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(_M_IX86) || defined(_M_X64) || defined(__i386__) || defined(__x86_64__)
+#define IMAGE_DIFF_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#define IMAGE_TARGET(isa)
+#else
+#define IMAGE_TARGET(isa) __attribute__((target(isa)))
+#endif
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define IMAGE_DIFF_NEON 1
+#include <arm_neon.h>
+#endif
+
+namespace aspect { namespace image {
+
+// Compare kernels, true if size bytes at a and b are equal. SIMD kernels
+// accumulate differences without branches, tile rows are short.
+
+static bool scalar_equal(uint8_t const* a, uint8_t const* b, size_t size)
+{
+	return memcmp(a, b, size) == 0;
+}
+
+#if IMAGE_DIFF_X86
+
+IMAGE_TARGET("sse2")
+static bool sse2_equal(uint8_t const* a, uint8_t const* b, size_t size)
+{
+	__m128i diff = _mm_setzero_si128();
+	size_t i = 0;
+	for (; i + 16 <= size; i += 16)
+	{
+		__m128i const pa = _mm_loadu_si128(reinterpret_cast<__m128i const*>(a + i));
+		__m128i const pb = _mm_loadu_si128(reinterpret_cast<__m128i const*>(b + i));
+		diff = _mm_or_si128(diff, _mm_xor_si128(pa, pb));
+	}
+	if (_mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128())) != 0xFFFF)
+	{
+		return false;
+	}
+	return i == size || memcmp(a + i, b + i, size - i) == 0;
+}
+
+IMAGE_TARGET("avx2")
+static bool avx2_equal(uint8_t const* a, uint8_t const* b, size_t size)
+{
+	__m256i diff = _mm256_setzero_si256();
+	size_t i = 0;
+	for (; i + 32 <= size; i += 32)
+	{
+		__m256i const pa = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(a + i));
+		__m256i const pb = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(b + i));
+		diff = _mm256_or_si256(diff, _mm256_xor_si256(pa, pb));
+	}
+	if (!_mm256_testz_si256(diff, diff))
+	{
+		return false;
+	}
+	return i == size || sse2_equal(a + i, b + i, size - i);
+}
+
+#endif // IMAGE_DIFF_X86
+
+#if IMAGE_DIFF_NEON
+
+static bool neon_equal(uint8_t const* a, uint8_t const* b, size_t size)
+{
+	uint8x16_t diff = vdupq_n_u8(0);
+	size_t i = 0;
+	for (; i + 16 <= size; i += 16)
+	{
+		diff = vorrq_u8(diff, veorq_u8(vld1q_u8(a + i), vld1q_u8(b + i)));
+	}
+	uint64x2_t const d = vreinterpretq_u64_u8(diff);
+	if (vgetq_lane_u64(d, 0) | vgetq_lane_u64(d, 1))
+	{
+		return false;
+	}
+	return i == size || memcmp(a + i, b + i, size - i) == 0;
+}
+
+#endif // IMAGE_DIFF_NEON
+
+frame_diff::frame_diff(int tile_size, simd_level max_simd)
+	: tile_size_(std::min(std::max(tile_size / 16 * 16, 16), 256))
+	, equal_(scalar_equal)
+	, reference_(ALLOC_UNINITIALIZED)
+	, has_reference_(false)
+	, columns_(0)
+	, dirty_tile_count_(0)
+{
+	simd_level const simd = convert_simd_level(max_simd);
+#if IMAGE_DIFF_X86
+	if (simd == SIMD_AVX2)
+	{
+		equal_ = avx2_equal;
+	}
+	else if (simd == SIMD_SSSE3)
+	{
+		equal_ = sse2_equal;
+	}
+#elif IMAGE_DIFF_NEON
+	if (simd == SIMD_NEON)
+	{
+		equal_ = neon_equal;
+	}
+#else
+	(void)simd;
+#endif
+}
+
+void frame_diff::reset()
+{
+	has_reference_ = false;
+}
+
+// Plane rows with tile width in bytes, chroma planes of 4:2:0 formats
+// are subsampled in both directions
+size_t frame_diff::get_planes(bitmap const& frame, plane_tiles (&planes)[bitmap::max_planes])
+{
+	encoding const format = frame.pixel_format();
+	size_t const count = frame.plane_count();
+	for (size_t i = 0; i < count; ++i)
+	{
+		plane_layout const& layout = frame.plane(i);
+		size_t const sample_bytes = (i == 0? bitmap::bytes_per_pixel(format)
+			: format == I420? 1 : 2 * bitmap::bytes_per_pixel(format));
+		int const shift = (i == 0? 0 : 1);
+
+		plane_tiles& p = planes[i];
+		p.src = frame.plane_data(i);
+		p.ref = reference_.plane_data(i);
+		p.src_stride = layout.stride;
+		p.ref_stride = reference_.plane(i).stride;
+		p.rows = layout.size.height;
+		p.row_bytes = layout.size.width * sample_bytes;
+		p.tile_bytes = (tile_size_ >> shift) * sample_bytes;
+		p.shift_y = shift;
+	}
+	return count;
+}
+
+// Mark tiles of band changed in any plane, whole rows are compared
+// first while the band is clean
+void frame_diff::compare_band(plane_tiles const* planes, size_t plane_count, size_t band)
+{
+	uint8_t* const tiles = &tiles_[band * columns_];
+	size_t dirty = 0;
+
+	for (size_t i = 0; i < plane_count; ++i)
+	{
+		plane_tiles const& p = planes[i];
+		size_t const first = (band * tile_size_) >> p.shift_y;
+		size_t const last = std::min(p.rows, ((band + 1) * tile_size_) >> p.shift_y);
+		for (size_t y = first; y < last; ++y)
+		{
+			uint8_t const* const src = p.src + y * p.src_stride;
+			uint8_t const* const ref = p.ref + y * p.ref_stride;
+			if (dirty == 0 && equal_(src, ref, p.row_bytes))
+			{
+				continue;
+			}
+			for (size_t x = 0; x < columns_; ++x)
+			{
+				size_t const begin = x * p.tile_bytes;
+				if (!tiles[x] && !equal_(src + begin, ref + begin, std::min(p.tile_bytes, p.row_bytes - begin)))
+				{
+					tiles[x] = 1;
+					++dirty;
+				}
+			}
+			if (dirty == columns_)
+			{
+				return;
+			}
+		}
+	}
+}
+
+// Copy dirty tiles of band, runs of adjacent tiles at once
+void frame_diff::copy_band(plane_tiles const* planes, size_t plane_count, size_t band, bool all)
+{
+	uint8_t const* const tiles = &tiles_[band * columns_];
+
+	for (size_t i = 0; i < plane_count; ++i)
+	{
+		plane_tiles const& p = planes[i];
+		size_t const first = (band * tile_size_) >> p.shift_y;
+		size_t const last = std::min(p.rows, ((band + 1) * tile_size_) >> p.shift_y);
+		for (size_t x = 0; x < columns_; )
+		{
+			if (!all && !tiles[x])
+			{
+				++x;
+				continue;
+			}
+			size_t end = x + 1;
+			while (end < columns_ && (all || tiles[end]))
+			{
+				++end;
+			}
+			size_t const begin = x * p.tile_bytes;
+			size_t const size = std::min(end * p.tile_bytes, p.row_bytes) - begin;
+			for (size_t y = first; y < last; ++y)
+			{
+				memcpy(p.ref + y * p.ref_stride + begin, p.src + y * p.src_stride + begin, size);
+			}
+			x = end;
+		}
+	}
+}
+
+// Merge horizontal runs of dirty tiles, then runs of the same span in
+// consecutive tile rows
+void frame_diff::coalesce(image_size const& size, std::vector<image_rect>& dirty) const
+{
+	size_t const rows = columns_? tiles_.size() / columns_ : 0;
+	std::vector<size_t> above, current; // indices in dirty of rects ending at the row
+
+	for (size_t row = 0; row < rows; ++row)
+	{
+		uint8_t const* const tiles = &tiles_[row * columns_];
+		current.clear();
+		for (size_t x = 0; x < columns_; )
+		{
+			if (!tiles[x])
+			{
+				++x;
+				continue;
+			}
+			size_t end = x + 1;
+			while (end < columns_ && tiles[end])
+			{
+				++end;
+			}
+
+			int const left = static_cast<int>(x) * tile_size_;
+			int const width = static_cast<int>(end - x) * tile_size_;
+			size_t index = dirty.size();
+			for (size_t i = 0; i < above.size(); ++i)
+			{
+				if (dirty[above[i]].left == left && dirty[above[i]].width == width)
+				{
+					index = above[i];
+					break;
+				}
+			}
+			if (index < dirty.size())
+			{
+				dirty[index].height += tile_size_;
+			}
+			else
+			{
+				dirty.push_back(image_rect(left, static_cast<int>(row) * tile_size_, width, tile_size_));
+			}
+			current.push_back(index);
+			x = end;
+		}
+		above.swap(current);
+	}
+
+	for (size_t i = 0; i < dirty.size(); ++i)
+	{
+		image_rect& r = dirty[i];
+		r.width = std::min(r.width, size.width - r.left);
+		r.height = std::min(r.height, size.height - r.top);
+	}
+}
+
+bool frame_diff::update(bitmap const& frame, std::vector<image_rect>& dirty)
+{
+	dirty.clear();
+	dirty_tile_count_ = 0;
+
+	image_size const size = frame.size();
+	if (size.is_empty() || !frame.data())
+	{
+		columns_ = 0;
+		tiles_.clear();
+		return false;
+	}
+
+	columns_ = (size.width + tile_size_ - 1) / tile_size_;
+	size_t const rows = (size.height + tile_size_ - 1) / tile_size_;
+
+	encoding const format = frame.pixel_format();
+	if (format == YUV10)
+	{
+		// v210 pixel groups are not byte aligned to tiles
+		has_reference_ = false;
+		tiles_.assign(columns_ * rows, 1);
+		dirty_tile_count_ = tiles_.size();
+		dirty.push_back(image_rect(0, 0, size.width, size.height));
+		return true;
+	}
+
+	bool const all = !has_reference_ || reference_.size() != size || reference_.pixel_format() != format;
+	if (all)
+	{
+		reference_.resize(size, format);
+	}
+	tiles_.assign(columns_ * rows, all? 1 : 0);
+
+	plane_tiles planes[bitmap::max_planes];
+	size_t const plane_count = get_planes(frame, planes);
+	for (size_t band = 0; band < rows; ++band)
+	{
+		if (!all)
+		{
+			compare_band(planes, plane_count, band);
+		}
+		copy_band(planes, plane_count, band, all);
+	}
+	has_reference_ = true;
+
+	dirty_tile_count_ = std::count(tiles_.begin(), tiles_.end(), 1);
+	coalesce(size, dirty);
+	return !dirty.empty();
+}
+
+}} // aspect::image
@@ -0,0 +1,63 @@
+#include "image/frame_publisher.hpp"
+
+#include <boost/make_shared.hpp>
+
+namespace aspect { namespace image {
+
+// a few free back buffers per size and format are enough for the writer
+// to swap them with frames still held by readers
+static size_t const max_free_back_buffers = 4;
+
+frame_publisher::frame_publisher(allocation alloc, size_t row_alignment)
+	: pool_(max_free_back_buffers, 0, alloc, row_alignment)
+	, generation_(0)
+{
+	pool_.set_name("frame_publisher");
+}
+
+frame_publisher::~frame_publisher()
+{
+}
+
+shared_bitmap_container frame_publisher::back_buffer(image_size const& size, encoding color_format,
+	encoding alpha_format, uint32_t flags)
+{
+	// bitmaps return to the pool only when their last reference,
+	// published or held by a reader, is released
+	shared_bitmap color = pool_.acquire(size, color_format);
+	shared_bitmap alpha;
+	if (alpha_format != UNKNOWN)
+	{
+		alpha = pool_.acquire(size, alpha_format);
+	}
+	return shared_bitmap_container(color, alpha, flags);
+}
+
+void frame_publisher::publish(shared_bitmap_container const& frame)
+{
+	published p = { frame, generation_.load(std::memory_order_relaxed) + 1 };
+	boost::atomic_store(&published_, boost::shared_ptr<published const>(boost::make_shared<published>(p)));
+	generation_.store(p.generation, std::memory_order_release);
+}
+
+void frame_publisher::clear()
+{
+	boost::atomic_store(&published_, boost::shared_ptr<published const>());
+}
+
+bool frame_publisher::snapshot(shared_bitmap_container& frame, uint64_t* generation) const
+{
+	boost::shared_ptr<published const> const p = boost::atomic_load(&published_);
+	if (!p)
+	{
+		return false;
+	}
+	frame = p->frame;
+	if (generation)
+	{
+		*generation = p->generation;
+	}
+	return true;
+}
+
+}} // aspect::image
@@ -0,0 +1,338 @@
+#include "image/image.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <new>
+#include <thread>
+
+#if OS(WINDOWS)
+#include <malloc.h>
+#else
+#include <stdlib.h>
+#endif
+
+#if OS(LINUX)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#if defined(__i386__) || defined(__x86_64__) || defined(_M_IX86) || defined(_M_X64)
+#include <immintrin.h>
+#endif
+
+namespace aspect { namespace image {
+
+static inline void cpu_relax()
+{
+#if defined(__i386__) || defined(__x86_64__) || defined(_M_IX86) || defined(_M_X64)
+	_mm_pause();
+#else
+	std::this_thread::yield();
+#endif
+}
+
+// spin iterations before yielding or blocking
+static int const spin_count = 100;
+
+static size_t ring_capacity(size_t capacity)
+{
+	size_t result = 2;
+	while (result < capacity)
+	{
+		result <<= 1;
+	}
+	return result;
+}
+
+frame_ring::cell* frame_ring::allocate_cells(size_t count)
+{
+	static_assert(sizeof(cell) % cache_line_size == 0, "frame_ring cells must fill whole cache lines");
+
+	size_t const size = count * sizeof(cell);
+#if OS(WINDOWS)
+	void* ptr = _aligned_malloc(size, cache_line_size);
+#else
+	void* ptr;
+	if (posix_memalign(&ptr, cache_line_size, size) != 0)
+	{
+		ptr = nullptr;
+	}
+#endif
+	if (!ptr)
+	{
+		throw std::bad_alloc();
+	}
+
+	cell* const cells = static_cast<cell*>(ptr);
+	for (size_t i = 0; i < count; ++i)
+	{
+		new (cells + i) cell();
+	}
+	return cells;
+}
+
+void frame_ring::free_cells(cell* cells, size_t count)
+{
+	for (size_t i = 0; i < count; ++i)
+	{
+		cells[i].~cell();
+	}
+#if OS(WINDOWS)
+	_aligned_free(cells);
+#else
+	free(cells);
+#endif
+}
+
+frame_ring::frame_ring(size_t capacity, wait_strategy wait, bool overwrite_oldest)
+	: cells_(allocate_cells(ring_capacity(capacity)))
+	, mask_(ring_capacity(capacity) - 1)
+	, wait_(wait)
+	, overwrite_oldest_(overwrite_oldest)
+	, depth_(mask_ + 1)
+	, tail_(0)
+	, head_(0)
+	, overwritten_(0)
+{
+	for (size_t i = 0; i <= mask_; ++i)
+	{
+		cells_[i].sequence.store(i, std::memory_order_relaxed);
+	}
+}
+
+frame_ring::~frame_ring()
+{
+	free_cells(cells_, mask_ + 1);
+}
+
+void frame_ring::set_depth(size_t depth)
+{
+	depth_.store(std::max<size_t>(1, std::min(depth, capacity())), std::memory_order_relaxed);
+	notify(not_full_);
+}
+
+size_t frame_ring::size() const
+{
+	size_t const head = head_.load(std::memory_order_relaxed);
+	size_t const tail = tail_.load(std::memory_order_relaxed);
+	return tail > head? tail - head : 0;
+}
+
+bool frame_ring::try_push(shared_bitmap_container const& frame, size_t depth)
+{
+	intptr_t const limit = static_cast<intptr_t>(depth? std::min(depth, capacity()) : depth_.load(std::memory_order_relaxed));
+	cell* c;
+	size_t pos = tail_.load(std::memory_order_relaxed);
+	for (;;)
+	{
+		c = &cells_[pos & mask_];
+		size_t const seq = c->sequence.load(std::memory_order_acquire);
+		intptr_t const diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+		if (diff == 0)
+		{
+			// pos may be stale and behind head, the compare and swap fails then
+			intptr_t const used = static_cast<intptr_t>(pos - head_.load(std::memory_order_acquire));
+			if (used >= limit)
+			{
+				return false; // ring is filled up to its depth
+			}
+			if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+			{
+				break;
+			}
+		}
+		else if (diff < 0)
+		{
+			return false; // cell is not popped yet since the previous lap
+		}
+		else
+		{
+			pos = tail_.load(std::memory_order_relaxed);
+		}
+	}
+
+	c->frame = frame;
+	c->sequence.store(pos + 1, std::memory_order_release);
+	notify(not_empty_);
+	return true;
+}
+
+bool frame_ring::try_pop(shared_bitmap_container& frame)
+{
+	cell* c;
+	size_t pos = head_.load(std::memory_order_relaxed);
+	for (;;)
+	{
+		c = &cells_[pos & mask_];
+		size_t const seq = c->sequence.load(std::memory_order_acquire);
+		intptr_t const diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+		if (diff == 0)
+		{
+			if (head_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+			{
+				break;
+			}
+		}
+		else if (diff < 0)
+		{
+			return false; // cell is not pushed yet
+		}
+		else
+		{
+			pos = head_.load(std::memory_order_relaxed);
+		}
+	}
+
+	frame = c->frame;
+	c->frame = shared_bitmap_container(); // do not keep bitmaps alive in free cells
+	c->sequence.store(pos + mask_ + 1, std::memory_order_release);
+	notify(not_full_);
+	return true;
+}
+
+bool frame_ring::push(shared_bitmap_container const& frame)
+{
+	if (!overwrite_oldest())
+	{
+		return push_for(frame, -1);
+	}
+
+	bool no_drops = true;
+	while (!try_push(frame))
+	{
+		// another consumer may pop the oldest frame first, try again then
+		shared_bitmap_container oldest;
+		if (try_pop(oldest))
+		{
+			overwritten_.fetch_add(1, std::memory_order_relaxed);
+			no_drops = false;
+		}
+	}
+	return no_drops;
+}
+
+bool frame_ring::push_for(shared_bitmap_container const& frame, int timeout_ms, size_t depth)
+{
+	return wait(not_full_, [&]() { return try_push(frame, depth); }, timeout_ms);
+}
+
+bool frame_ring::pop_for(shared_bitmap_container& frame, int timeout_ms)
+{
+	return wait(not_empty_, [&]() { return try_pop(frame); }, timeout_ms);
+}
+
+void frame_ring::clear()
+{
+	shared_bitmap_container frame;
+	while (try_pop(frame))
+	{
+	}
+}
+
+#if OS(LINUX)
+static void futex_wait(std::atomic<uint32_t>& addr, uint32_t expected, timespec const* timeout)
+{
+	syscall(SYS_futex, reinterpret_cast<uint32_t*>(&addr), FUTEX_WAIT_PRIVATE, expected, timeout, nullptr, 0);
+}
+
+static void futex_wake_all(std::atomic<uint32_t>& addr)
+{
+	syscall(SYS_futex, reinterpret_cast<uint32_t*>(&addr), FUTEX_WAKE_PRIVATE, INT_MAX, nullptr, nullptr, 0);
+}
+#endif
+
+template<typename Ready>
+bool frame_ring::wait(waiter& w, Ready ready, int timeout_ms)
+{
+	typedef std::chrono::steady_clock clock;
+	clock::time_point const deadline = clock::now() + std::chrono::milliseconds(std::max(timeout_ms, 0));
+
+	for (int spin = 0; ; ++spin)
+	{
+		if (ready())
+		{
+			return true;
+		}
+		if (timeout_ms == 0 || (timeout_ms > 0 && (spin >= spin_count || (spin & 63) == 0) && clock::now() >= deadline))
+		{
+			return false;
+		}
+
+		if (wait_ == SPIN || spin < spin_count)
+		{
+			cpu_relax();
+		}
+		else if (wait_ == YIELD)
+		{
+			std::this_thread::yield();
+		}
+		else
+		{
+			// register as waiter before checking readiness once more,
+			// notify() sees the waiter or the check sees the new state
+			w.count.fetch_add(1, std::memory_order_seq_cst);
+			uint32_t const sequence = w.sequence.load(std::memory_order_seq_cst);
+			bool const is_ready = ready();
+			if (!is_ready)
+			{
+#if OS(LINUX)
+				timespec timeout;
+				timespec* timeout_ptr = nullptr;
+				if (timeout_ms > 0)
+				{
+					long long const ns = std::chrono::duration_cast<std::chrono::nanoseconds>(deadline - clock::now()).count();
+					timeout.tv_sec = ns > 0? static_cast<time_t>(ns / 1000000000) : 0;
+					timeout.tv_nsec = ns > 0? static_cast<long>(ns % 1000000000) : 0;
+					timeout_ptr = &timeout;
+				}
+				futex_wait(w.sequence, sequence, timeout_ptr);
+#else
+				boost::mutex::scoped_lock lock(w.mutex);
+				if (w.sequence.load(std::memory_order_seq_cst) == sequence)
+				{
+					if (timeout_ms > 0)
+					{
+						w.cond.wait_for(lock, boost::chrono::milliseconds(std::max<long long>(0,
+							std::chrono::duration_cast<std::chrono::milliseconds>(deadline - clock::now()).count())));
+					}
+					else
+					{
+						w.cond.wait(lock);
+					}
+				}
+#endif
+			}
+			w.count.fetch_sub(1, std::memory_order_relaxed);
+			if (is_ready)
+			{
+				return true;
+			}
+			spin = spin_count; // keep blocking without spinning again
+		}
+	}
+}
+
+void frame_ring::notify(waiter& w)
+{
+	if (wait_ != BLOCK)
+	{
+		return;
+	}
+
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (w.count.load(std::memory_order_seq_cst))
+	{
+		w.sequence.fetch_add(1, std::memory_order_seq_cst);
+#if OS(LINUX)
+		futex_wake_all(w.sequence);
+#else
+		boost::mutex::scoped_lock lock(w.mutex);
+		w.cond.notify_all();
+#endif
+	}
+}
+
+}} // aspect::image
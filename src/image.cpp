@@ -1,6 +1,27 @@
 #include "image/image.hpp"
+#include "image/memory.hpp"
 #include "jsx/library.hpp"
 
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <new>
+#include <thread>
+
+#if OS(WINDOWS)
+#include <windows.h>
+#include <malloc.h>
+#else
+#include <sys/mman.h>
+#include <stdlib.h>
+#include <unistd.h>
+#endif
+
+#if OS(LINUX)
+#include <poll.h>
+#include <sys/eventfd.h>
+#endif
+
 namespace aspect { namespace image {
 
 // https://github.com/ofTheo/videoInput/blob/master/videoInputSrcAndDemos/libs/videoInput/videoInput.cpp
@@ -18,6 +39,8 @@ v8::Handle<v8::Value> image_install(v8::Isolate* isolate)
 		;
 	image_module.set("__image_device_interface", device_class);
 
+	image_module.set("get_memory_info", &memory::get_info);
+
 	return image_module.new_instance();
 }
 
@@ -27,7 +50,263 @@ void image_uninstall(v8::Isolate* isolate, v8::Handle<v8::Value> library)
 	(void)library;
 }
 
-size_t bitmap::total_memory_ = 0;
+// alignment of bitmap pixel data suitable for AVX loads and stores
+static size_t const data_alignment = 32;
+
+// huge page size; smaller bitmaps are allocated on heap to avoid wasting memory
+static size_t const huge_page_size = 2 * 1024 * 1024;
+
+static uint8_t* heap_allocate(size_t size, size_t alignment)
+{
+	alignment = std::max(alignment, data_alignment);
+#if OS(WINDOWS)
+	return static_cast<uint8_t*>(_aligned_malloc(size, alignment));
+#else
+	void* ptr;
+	return posix_memalign(&ptr, alignment, size) == 0? static_cast<uint8_t*>(ptr) : nullptr;
+#endif
+}
+
+static void heap_free(uint8_t* ptr)
+{
+#if OS(WINDOWS)
+	_aligned_free(ptr);
+#else
+	free(ptr);
+#endif
+}
+
+/// Map memory backed with huge pages, returns nullptr if not available.
+/// On success size is rounded up to the huge page size.
+static uint8_t* map_huge_pages(size_t& size)
+{
+#if OS(WINDOWS)
+	// large pages require SeLockMemoryPrivilege for the process
+	size_t const page_size = GetLargePageMinimum();
+	if (!page_size)
+	{
+		return nullptr;
+	}
+	size_t const mapped_size = (size + page_size - 1) & ~(page_size - 1);
+	void* ptr = VirtualAlloc(nullptr, mapped_size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE);
+	if (!ptr)
+	{
+		return nullptr;
+	}
+	size = mapped_size;
+	return static_cast<uint8_t*>(ptr);
+#else
+	size_t const mapped_size = (size + huge_page_size - 1) & ~(huge_page_size - 1);
+	void* ptr = MAP_FAILED;
+#ifdef MAP_HUGETLB
+	// explicit huge pages, reserved by the system administrator
+	ptr = mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+	if (ptr == MAP_FAILED)
+	{
+		// transparent huge pages need a huge page aligned region,
+		// so map one page more and unmap unaligned head and tail
+		uint8_t* region = static_cast<uint8_t*>(mmap(nullptr, mapped_size + huge_page_size,
+			PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+		if (region == MAP_FAILED)
+		{
+			return nullptr;
+		}
+		size_t const head = (huge_page_size - reinterpret_cast<uintptr_t>(region) % huge_page_size) % huge_page_size;
+		if (head)
+		{
+			munmap(region, head);
+		}
+		munmap(region + head + mapped_size, huge_page_size - head);
+		ptr = region + head;
+#ifdef MADV_HUGEPAGE
+		madvise(ptr, mapped_size, MADV_HUGEPAGE);
+#endif
+	}
+	size = mapped_size;
+	return static_cast<uint8_t*>(ptr);
+#endif
+}
+
+static void unmap_huge_pages(uint8_t* ptr, size_t size)
+{
+#if OS(WINDOWS)
+	(void)size;
+	VirtualFree(ptr, 0, MEM_RELEASE);
+#else
+	munmap(ptr, size);
+#endif
+}
+
+bitmap::bitmap(image_size const& size, encoding pixel_format, uint8_t* data, size_t data_size,
+		boost::shared_ptr<bitmap_storage> const& storage, size_t row_alignment)
+	: size_(size)
+	, pixel_format_(pixel_format)
+	, allocation_(ALLOC_UNINITIALIZED)
+	, row_alignment_(row_alignment)
+	, data_(data)
+	, data_size_(0)
+	, capacity_(data_size)
+	, mapped_(false)
+	, storage_(storage)
+	, plane_count_(plane_count(pixel_format))
+{
+	data_size_ = get_layout(size, pixel_format, planes_, row_alignment_);
+	_aspect_assert(data_size_ <= capacity_);
+	_aspect_assert(reinterpret_cast<uintptr_t>(data_) % row_alignment_ == 0);
+	memory::bitmap_allocated(pixel_format_, capacity_);
+}
+
+bitmap::~bitmap()
+{
+	deallocate();
+}
+
+void bitmap::resize(image_size const& size, encoding pixel_format)
+{
+	boost::unique_lock<boost::shared_mutex> lock(shared_mutex_);
+
+	if (size != size_ || pixel_format_ != pixel_format)
+	{
+		layout(size, pixel_format);
+	}
+}
+
+bool bitmap::set_row_alignment(size_t row_alignment)
+{
+	boost::unique_lock<boost::shared_mutex> lock(shared_mutex_);
+
+	if (row_alignment != row_alignment_)
+	{
+		if (storage_)
+		{
+			// the external storage layout is shared with its owner
+			return false;
+		}
+		row_alignment_ = row_alignment;
+		if (data_)
+		{
+			// storage alignment may be insufficient for the new row alignment
+			deallocate();
+			layout(size_, pixel_format_);
+		}
+	}
+	return true;
+}
+
+void bitmap::layout(image_size const& size, encoding pixel_format)
+{
+	_aspect_assert(row_alignment_ && (row_alignment_ & (row_alignment_ - 1)) == 0);
+
+	allocate(get_layout(size, pixel_format, planes_, row_alignment_), pixel_format);
+	plane_count_ = plane_count(pixel_format);
+
+	size_ = size;
+	pixel_format_ = pixel_format;
+}
+
+static inline size_t align_up(size_t value, size_t alignment)
+{
+	return (value + alignment - 1) & ~(alignment - 1);
+}
+
+size_t bitmap::get_layout(image_size const& size, encoding pixel_format, plane_layout (&planes)[max_planes],
+	size_t row_alignment)
+{
+	size_t const width = size.width;
+	size_t const height = size.height;
+	size_t const chroma_width = (width + 1) / 2;
+	size_t const chroma_height = (height + 1) / 2;
+
+	// planes follow each other, each one starts at row alignment as its rows do
+	planes[0].offset = 0;
+	planes[0].stride = align_up(width * bytes_per_pixel(pixel_format), row_alignment);
+	planes[0].size = size;
+
+	size_t const luma_size = planes[0].stride * height;
+	switch (pixel_format)
+	{
+	case I420:
+		for (size_t i = 1; i < 3; ++i)
+		{
+			planes[i].stride = align_up(chroma_width, row_alignment);
+			planes[i].offset = luma_size + (i - 1) * planes[i].stride * chroma_height;
+			planes[i].size = image_size(static_cast<int>(chroma_width), static_cast<int>(chroma_height));
+		}
+		return planes[2].offset + planes[2].stride * chroma_height;
+	case NV12:
+	case P010:
+		planes[1].offset = luma_size;
+		planes[1].stride = align_up(chroma_width * 2 * bytes_per_pixel(pixel_format), row_alignment);
+		planes[1].size = image_size(static_cast<int>(chroma_width), static_cast<int>(chroma_height));
+		return planes[1].offset + planes[1].stride * chroma_height;
+	default:
+		return luma_size;
+	}
+}
+
+void bitmap::allocate(size_t size, encoding pixel_format)
+{
+	if (size > capacity_)
+	{
+		deallocate();
+
+		size_t capacity = size;
+		uint8_t* data = nullptr;
+		if (allocation_ == ALLOC_HUGE_PAGES && size >= huge_page_size)
+		{
+			data = map_huge_pages(capacity);
+			mapped_ = (data != nullptr);
+		}
+		if (!data)
+		{
+			capacity = size;
+			data = heap_allocate(size, row_alignment_);
+			if (!data)
+			{
+				throw std::bad_alloc();
+			}
+		}
+		data_ = data;
+		capacity_ = capacity;
+		data_size_ = 0;
+		memory::bitmap_allocated(pixel_format, capacity_);
+	}
+	else if (data_)
+	{
+		memory::bitmap_encoding_changed(pixel_format_, pixel_format, capacity_);
+	}
+
+	// storage is kept on shrinking, zero only the grown part
+	if (allocation_ == ALLOC_ZEROED && size > data_size_)
+	{
+		memset(data_ + data_size_, 0, size - data_size_);
+	}
+	data_size_ = size;
+}
+
+void bitmap::deallocate()
+{
+	if (data_)
+	{
+		memory::bitmap_freed(pixel_format_, capacity_);
+		if (storage_)
+		{
+			storage_.reset();
+		}
+		else if (mapped_)
+		{
+			unmap_huge_pages(data_, capacity_);
+		}
+		else
+		{
+			heap_free(data_);
+		}
+	}
+	data_ = nullptr;
+	data_size_ = capacity_ = 0;
+	mapped_ = false;
+}
 
 enum grid_type { GRID_LINE, GRID_1, GRID_2 };
 
@@ -40,10 +319,9 @@ static inline grid_type get_grid(int x, int y)
 
 void bitmap::checker3(const uint32_t c1, const uint32_t c2, const uint32_t c3)
 {
-	uint32_t* tmp = reinterpret_cast<uint32_t*>(data());
-
 	for (int y = 0; y < size_.height; ++y)
 	{
+		uint32_t* tmp = reinterpret_cast<uint32_t*>(data() + y * stride());
 		for (int x = 0; x < size_.width; ++x, ++tmp)
 		{
 			switch( get_grid(x,y) )
@@ -58,9 +336,9 @@ void bitmap::checker3(const uint32_t c1, const uint32_t c2, const uint32_t c3)
 
 void bitmap::checker2(uint32_t c1, uint32_t c2)
 {
-	uint32_t* tmp = reinterpret_cast<uint32_t*>(data());
 	for (int y=0; y < size_.height; ++y)
 	{
+		uint32_t* tmp = reinterpret_cast<uint32_t*>(data() + y * stride());
 		for (int x=0; x < size_.width; ++x, ++tmp)
 		{
 			*tmp = ((x>>3)^(y>>3) & 1? c1 : c2);
@@ -68,32 +346,322 @@ void bitmap::checker2(uint32_t c1, uint32_t c2)
 	}
 }
 
-void device::schedule_input_frame(shared_bitmap_container const& frame, bool drop_frames)
+void device::set_drop_policy(drop_policy policy, size_t depth, int block_timeout_ms)
 {
-	capture_queue_.push(frame);
+	drop_policy_.store(policy, std::memory_order_relaxed);
+	block_timeout_ms_.store(block_timeout_ms, std::memory_order_relaxed);
+	capture_queue_.set_overwrite_oldest(policy == DROP_OLDEST || policy == MAILBOX);
+	capture_queue_.set_depth(policy == MAILBOX? 1 : depth);
+}
 
-	// clear up the queue so that at most we have 2 pending frames
-	if (drop_frames)
+device::frame_stats device::get_frame_stats() const
+{
+	frame_stats stats;
+	stats.scheduled = scheduled_frames_.load(std::memory_order_relaxed);
+	stats.queued = queued_frames_.load(std::memory_order_relaxed);
+	stats.dropped_oldest = dropped_oldest_.load(std::memory_order_relaxed);
+	stats.dropped_newest = dropped_newest_.load(std::memory_order_relaxed);
+	stats.blocked = blocked_frames_.load(std::memory_order_relaxed);
+	stats.block_timeouts = block_timeouts_.load(std::memory_order_relaxed);
+	return stats;
+}
+
+void device::drop_input_frame(std::atomic<uint64_t>& counter)
+{
+	counter.fetch_add(1, std::memory_order_relaxed);
+	++dropped_frames_;
+}
+
+bool device::acquire_input_frame(shared_bitmap_container& frame)
+{
+	if (!capture_queue_.try_pop(frame))
 	{
-		while (capture_queue_.size() > 2)
+		return false;
+	}
+	input_frame_acquired(frame);
+	return true;
+}
+
+void device::acquire_input_frame_blocking(shared_bitmap_container& frame)
+{
+	capture_queue_.wait_and_pop(frame);
+	input_frame_acquired(frame);
+}
+
+bool device::acquire_input_frame_for(shared_bitmap_container& frame, int timeout_ms)
+{
+	if (!capture_queue_.pop_for(frame, timeout_ms))
+	{
+		return false;
+	}
+	input_frame_acquired(frame);
+	return true;
+}
+
+size_t device::acquire_input_frames(std::vector<shared_bitmap_container>& frames, size_t max, int timeout_ms)
+{
+	size_t count = 0;
+	shared_bitmap_container frame;
+	if (max > 0 && capture_queue_.pop_for(frame, timeout_ms))
+	{
+		do
+		{
+			input_frame_acquired(frame);
+			frames.push_back(frame);
+		}
+		while (++count < max && capture_queue_.try_pop(frame));
+	}
+	return count;
+}
+
+void device::release_input_frame(shared_bitmap_container const& frame)
+{
+	if (frame.acquire_time())
+	{
+		acquire_to_release_.record(monotonic_time() - frame.acquire_time());
+	}
+
+	// frames over capacity are freed
+	shared_bitmap_container available = frame;
+	available.reset_timestamps();
+	available_queue_.try_push(available);
+}
+
+void device::input_frame_acquired(shared_bitmap_container& frame)
+{
+	uint64_t const now = monotonic_time();
+	frame.set_acquire_time(now);
+	if (frame.capture_time())
+	{
+		capture_to_acquire_.record(now - frame.capture_time());
+	}
+}
+
+void device::output_frame_presented(shared_bitmap_container const& frame)
+{
+	if (frame.schedule_time())
+	{
+		schedule_to_output_.record(monotonic_time() - frame.schedule_time());
+	}
+}
+
+void device::open_input_event()
+{
+#if OS(LINUX)
+	input_event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#endif
+}
+
+void device::close_input_event()
+{
+#if OS(LINUX)
+	if (input_event_fd_ >= 0)
+	{
+		::close(input_event_fd_);
+		input_event_fd_ = -1;
+	}
+#endif
+}
+
+void device::input_frame_queued()
+{
+	queued_frames_.fetch_add(1, std::memory_order_relaxed);
+
+	// signal only when someone waits, wait_input_frames() registers
+	// as a waiter before checking the queue
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (input_event_fd_ >= 0 && input_waiters_.load(std::memory_order_seq_cst))
+	{
+#if OS(LINUX)
+		uint64_t const one = 1;
+		ssize_t const written = write(input_event_fd_, &one, sizeof(one));
+		(void)written; // the counter may only overflow with nobody reading it
+#endif
+	}
+}
+
+int device::wait_input_frames(device* const* devices, size_t count, int timeout_ms)
+{
+	typedef std::chrono::steady_clock clock;
+	clock::time_point const deadline = clock::now() + std::chrono::milliseconds(std::max(timeout_ms, 0));
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		devices[i]->input_waiters_.fetch_add(1, std::memory_order_seq_cst);
+	}
+
+#if OS(LINUX)
+	// poll() ignores devices without event descriptor, check them each millisecond
+	int poll_slice_ms = -1;
+	std::vector<pollfd> fds(count);
+	for (size_t i = 0; i < count; ++i)
+	{
+		fds[i].fd = devices[i]->input_event_fd();
+		fds[i].events = POLLIN;
+		fds[i].revents = 0;
+		if (fds[i].fd < 0)
+		{
+			poll_slice_ms = 1;
+		}
+	}
+#endif
+
+	int result = -1;
+	for (;;)
+	{
+		for (size_t i = 0; i < count && result < 0; ++i)
+		{
+			if (devices[i]->has_input_frames())
+			{
+				result = static_cast<int>(i);
+			}
+		}
+
+		int wait_ms = -1;
+		if (timeout_ms >= 0)
+		{
+			wait_ms = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(deadline - clock::now()).count());
+		}
+		if (result >= 0 || (timeout_ms >= 0 && wait_ms <= 0))
+		{
+			break;
+		}
+
+#if OS(LINUX)
+		if (poll_slice_ms > 0 && (wait_ms < 0 || wait_ms > poll_slice_ms))
+		{
+			wait_ms = poll_slice_ms;
+		}
+		if (poll(fds.data(), static_cast<nfds_t>(fds.size()), wait_ms) > 0)
 		{
-			if (trace_dropped_frames_)
+			// reset signaled events, queues are checked again
+			for (size_t i = 0; i < count; ++i)
 			{
-				printf("image::device \"%s\" dropping input frame\n", name_.c_str());
+				uint64_t value;
+				if ((fds[i].revents & POLLIN) && read(fds[i].fd, &value, sizeof(value)) < 0)
+				{
+					// EAGAIN: reset by another waiter
+				}
 			}
-			shared_bitmap_container container;
-			capture_queue_.try_pop(container);
-			++dropped_frames_;
 		}
+#else
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+#endif
 	}
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		devices[i]->input_waiters_.fetch_sub(1, std::memory_order_relaxed);
+	}
+	return result;
+}
+
+void device::schedule_input_frame(shared_bitmap_container const& input_frame, bool drop_frames)
+{
+	scheduled_frames_.fetch_add(1, std::memory_order_relaxed);
+
+	shared_bitmap_container frame = input_frame;
+	frame.set_sequence(next_sequence_.fetch_add(1, std::memory_order_relaxed) + 1);
+	if (!frame.capture_time())
+	{
+		frame.set_capture_time(monotonic_time());
+	}
+
+	if (!drop_frames)
+	{
+		// lossless, queue up to the whole ring beyond the drop policy depth
+		if (capture_queue_.try_push(frame, capture_queue_capacity))
+		{
+			input_frame_queued();
+			return;
+		}
+		blocked_frames_.fetch_add(1, std::memory_order_relaxed);
+		if (capture_queue_.push_for(frame, get_lossless_timeout(), capture_queue_capacity))
+		{
+			input_frame_queued();
+		}
+		else
+		{
+			drop_input_frame(block_timeouts_);
+		}
+		return;
+	}
+
+	if (capture_queue_.try_push(frame))
+	{
+		input_frame_queued();
+		return;
+	}
+
+	// the queue is filled up to its depth
+	int const timeout_ms = block_timeout_ms_.load(std::memory_order_relaxed);
+	switch (get_drop_policy())
+	{
+	case DROP_OLDEST:
+	case MAILBOX:
+		{
+			// the ring drops the oldest pending frames in overwrite mode
+			uint64_t const overwritten = capture_queue_.overwritten();
+			capture_queue_.push(frame);
+			for (uint64_t n = capture_queue_.overwritten() - overwritten; n > 0; --n)
+			{
+				drop_input_frame(dropped_oldest_);
+			}
+			input_frame_queued();
+		}
+		break;
+	case DROP_NEWEST:
+		drop_input_frame(dropped_newest_);
+		break;
+	case BLOCK_PRODUCER:
+		blocked_frames_.fetch_add(1, std::memory_order_relaxed);
+		if (capture_queue_.push_for(frame, timeout_ms))
+		{
+			input_frame_queued();
+		}
+		else
+		{
+			drop_input_frame(block_timeouts_);
+		}
+		break;
+	}
+}
+
+static char const* drop_policy_name(device::drop_policy policy)
+{
+	switch (policy)
+	{
+	case device::DROP_OLDEST:    return "drop_oldest";
+	case device::MAILBOX:        return "mailbox";
+	case device::DROP_NEWEST:    return "drop_newest";
+	case device::BLOCK_PRODUCER: return "block_producer";
+	}
+	return "";
 }
 
 v8::Handle<v8::Value> device::get_info(v8::Isolate* isolate) const
 {
 	v8::EscapableHandleScope scope(isolate);
 
+	frame_stats const stats = get_frame_stats();
+
 	v8::Local<v8::Object> o = v8::Object::New(isolate);
-	set_option(isolate, o, "dropped_frames", dropped_frames_);
+	set_option(isolate, o, "dropped_frames", get_dropped_frames());
+	set_option(isolate, o, "drop_policy", drop_policy_name(get_drop_policy()));
+	set_option(isolate, o, "queue_depth", static_cast<double>(get_queue_depth()));
+	set_option(isolate, o, "pending_frames", static_cast<double>(capture_queue_.size()));
+	set_option(isolate, o, "scheduled_frames", static_cast<double>(stats.scheduled));
+	set_option(isolate, o, "queued_frames", static_cast<double>(stats.queued));
+	set_option(isolate, o, "dropped_oldest", static_cast<double>(stats.dropped_oldest));
+	set_option(isolate, o, "dropped_newest", static_cast<double>(stats.dropped_newest));
+	set_option(isolate, o, "blocked_frames", static_cast<double>(stats.blocked));
+	set_option(isolate, o, "block_timeouts", static_cast<double>(stats.block_timeouts));
+
+	v8::Local<v8::Object> latency = v8::Object::New(isolate);
+	set_option(isolate, latency, "capture_to_acquire", capture_to_acquire_.get_info(isolate));
+	set_option(isolate, latency, "acquire_to_release", acquire_to_release_.get_info(isolate));
+	set_option(isolate, latency, "schedule_to_output", schedule_to_output_.get_info(isolate));
+	set_option(isolate, o, "latency", latency);
 
 	return scope.Escape(o);
 }
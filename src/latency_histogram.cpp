@@ -0,0 +1,138 @@
+#include "image/image.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace aspect { namespace image {
+
+latency_histogram::latency_histogram()
+{
+	reset();
+}
+
+static inline unsigned highest_bit(uint64_t value)
+{
+	unsigned result = 0;
+	while (value >>= 1)
+	{
+		++result;
+	}
+	return result;
+}
+
+// values below 2 * sub_bucket_count have own buckets, then each power of 2
+// range is split into sub_bucket_count linear buckets
+unsigned latency_histogram::bucket_index(uint64_t ns)
+{
+	ns = std::min(ns, (uint64_t(1) << max_value_bits) - 1);
+	if (ns < sub_bucket_count)
+	{
+		return static_cast<unsigned>(ns);
+	}
+	unsigned const shift = highest_bit(ns) - sub_bucket_bits;
+	return (shift + 1) * sub_bucket_count + static_cast<unsigned>(ns >> shift) - sub_bucket_count;
+}
+
+// middle value of a bucket
+uint64_t latency_histogram::bucket_value(unsigned index)
+{
+	if (index < 2 * sub_bucket_count)
+	{
+		return index;
+	}
+	unsigned const shift = index / sub_bucket_count - 1;
+	uint64_t const lowest = uint64_t(index % sub_bucket_count + sub_bucket_count) << shift;
+	return lowest + (uint64_t(1) << shift) / 2;
+}
+
+void latency_histogram::record(uint64_t ns)
+{
+	buckets_[bucket_index(ns)].fetch_add(1, std::memory_order_relaxed);
+	count_.fetch_add(1, std::memory_order_relaxed);
+	sum_.fetch_add(ns, std::memory_order_relaxed);
+
+	uint64_t min = min_.load(std::memory_order_relaxed);
+	while (ns < min && !min_.compare_exchange_weak(min, ns, std::memory_order_relaxed))
+	{
+	}
+	uint64_t max = max_.load(std::memory_order_relaxed);
+	while (ns > max && !max_.compare_exchange_weak(max, ns, std::memory_order_relaxed))
+	{
+	}
+}
+
+uint64_t latency_histogram::percentile(double p) const
+{
+	uint64_t total = 0;
+	for (unsigned i = 0; i < bucket_count; ++i)
+	{
+		total += buckets_[i].load(std::memory_order_relaxed);
+	}
+	if (total == 0)
+	{
+		return 0;
+	}
+
+	uint64_t const rank = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(std::min(std::max(p, 0.0), 100.0) / 100 * total)));
+	uint64_t seen = 0;
+	for (unsigned i = 0; i < bucket_count; ++i)
+	{
+		seen += buckets_[i].load(std::memory_order_relaxed);
+		if (seen >= rank)
+		{
+			// bucket middle value may be out of the recorded range
+			return std::min(std::max(bucket_value(i), min_.load(std::memory_order_relaxed)),
+				max_.load(std::memory_order_relaxed));
+		}
+	}
+	return max_.load(std::memory_order_relaxed);
+}
+
+latency_histogram::summary latency_histogram::get_summary() const
+{
+	summary result;
+	result.count = count_.load(std::memory_order_relaxed);
+	result.min = result.count? min_.load(std::memory_order_relaxed) : 0;
+	result.max = max_.load(std::memory_order_relaxed);
+	result.mean = result.count? static_cast<double>(sum_.load(std::memory_order_relaxed)) / result.count : 0;
+	result.p50 = percentile(50);
+	result.p90 = percentile(90);
+	result.p99 = percentile(99);
+	result.p999 = percentile(99.9);
+	return result;
+}
+
+v8::Handle<v8::Value> latency_histogram::get_info(v8::Isolate* isolate) const
+{
+	v8::EscapableHandleScope scope(isolate);
+
+	summary const s = get_summary();
+	double const ms = 1e-6;
+
+	v8::Local<v8::Object> o = v8::Object::New(isolate);
+	set_option(isolate, o, "count", static_cast<double>(s.count));
+	set_option(isolate, o, "min", s.min * ms);
+	set_option(isolate, o, "max", s.max * ms);
+	set_option(isolate, o, "mean", s.mean * ms);
+	set_option(isolate, o, "p50", s.p50 * ms);
+	set_option(isolate, o, "p90", s.p90 * ms);
+	set_option(isolate, o, "p99", s.p99 * ms);
+	set_option(isolate, o, "p999", s.p999 * ms);
+
+	return scope.Escape(o);
+}
+
+void latency_histogram::reset()
+{
+	for (unsigned i = 0; i < bucket_count; ++i)
+	{
+		buckets_[i].store(0, std::memory_order_relaxed);
+	}
+	count_.store(0, std::memory_order_relaxed);
+	sum_.store(0, std::memory_order_relaxed);
+	min_.store(std::numeric_limits<uint64_t>::max(), std::memory_order_relaxed);
+	max_.store(0, std::memory_order_relaxed);
+}
+
+}} // aspect::image
@@ -0,0 +1,228 @@
+#include "image/memory.hpp"
+
+#include <boost/thread/mutex.hpp>
+
+#include <chrono>
+#include <map>
+
+namespace aspect { namespace image {
+
+static double steady_time()
+{
+	return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+double memory_usage::allocation_rate(memory_usage const& earlier) const
+{
+	double const elapsed = time - earlier.time;
+	return elapsed > 0? (allocations - earlier.allocations) / elapsed : 0;
+}
+
+double memory_usage::allocated_bytes_rate(memory_usage const& earlier) const
+{
+	double const elapsed = time - earlier.time;
+	return elapsed > 0? (allocated_bytes - earlier.allocated_bytes) / elapsed : 0;
+}
+
+template<typename T>
+static void update_peak(std::atomic<T>& peak, T value)
+{
+	T current = peak.load(std::memory_order_relaxed);
+	while (value > current && !peak.compare_exchange_weak(current, value, std::memory_order_relaxed))
+	{
+	}
+}
+
+memory_counter::memory_counter()
+	: bytes_(0)
+	, count_(0)
+	, peak_bytes_(0)
+	, peak_count_(0)
+	, allocations_(0)
+	, allocated_bytes_(0)
+{
+}
+
+void memory_counter::add(size_t bytes, bool allocation)
+{
+	update_peak(peak_bytes_, bytes_.fetch_add(bytes, std::memory_order_relaxed) + bytes);
+	update_peak(peak_count_, count_.fetch_add(1, std::memory_order_relaxed) + 1);
+	if (allocation)
+	{
+		allocations_.fetch_add(1, std::memory_order_relaxed);
+		allocated_bytes_.fetch_add(bytes, std::memory_order_relaxed);
+	}
+}
+
+void memory_counter::remove(size_t bytes)
+{
+	bytes_.fetch_sub(bytes, std::memory_order_relaxed);
+	count_.fetch_sub(1, std::memory_order_relaxed);
+}
+
+memory_usage memory_counter::usage() const
+{
+	memory_usage result;
+	result.bytes = bytes_.load(std::memory_order_relaxed);
+	result.count = count_.load(std::memory_order_relaxed);
+	result.peak_bytes = peak_bytes_.load(std::memory_order_relaxed);
+	result.peak_count = peak_count_.load(std::memory_order_relaxed);
+	result.allocations = allocations_.load(std::memory_order_relaxed);
+	result.allocated_bytes = allocated_bytes_.load(std::memory_order_relaxed);
+	result.time = steady_time();
+	return result;
+}
+
+void memory_counter::reset_peak()
+{
+	peak_bytes_.store(bytes_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+	peak_count_.store(count_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+}
+
+namespace memory {
+
+static encoding const encodings[] = { UNKNOWN, YUV8, YUV10, A8, RGBA8, ARGB8, BGRA8, RGB8, RGB10, RGB32F, I420, NV12, P010 };
+static size_t const encoding_count = sizeof(encodings) / sizeof(encodings[0]);
+
+static char const* encoding_name(encoding pixel_format)
+{
+	switch (pixel_format)
+	{
+	case YUV8:   return "YUV8";
+	case YUV10:  return "YUV10";
+	case A8:     return "A8";
+	case RGBA8:  return "RGBA8";
+	case ARGB8:  return "ARGB8";
+	case BGRA8:  return "BGRA8";
+	case RGB8:   return "RGB8";
+	case RGB10:  return "RGB10";
+	case RGB32F: return "RGB32F";
+	case I420:   return "I420";
+	case NV12:   return "NV12";
+	case P010:   return "P010";
+	default:     return "UNKNOWN";
+	}
+}
+
+memory_counter& total()
+{
+	static memory_counter counter;
+	return counter;
+}
+
+memory_counter& for_encoding(encoding pixel_format)
+{
+	static memory_counter counters[encoding_count];
+	size_t const index = static_cast<size_t>(pixel_format);
+	return counters[index < encoding_count? index : 0];
+}
+
+// registered counters with their names, and the snapshots of the previous get_info() call
+struct registry
+{
+	boost::mutex mutex;
+	std::map<memory_counter const*, std::string> counters;
+	std::map<std::string, memory_usage> previous;
+
+	static registry& instance()
+	{
+		static registry inst;
+		return inst;
+	}
+};
+
+void register_counter(memory_counter const& counter, std::string const& name)
+{
+	registry& reg = registry::instance();
+	boost::mutex::scoped_lock lock(reg.mutex);
+	reg.counters[&counter] = name;
+}
+
+void unregister_counter(memory_counter const& counter)
+{
+	registry& reg = registry::instance();
+	boost::mutex::scoped_lock lock(reg.mutex);
+	reg.counters.erase(&counter);
+}
+
+void bitmap_allocated(encoding pixel_format, size_t bytes)
+{
+	total().add(bytes);
+	for_encoding(pixel_format).add(bytes);
+}
+
+void bitmap_freed(encoding pixel_format, size_t bytes)
+{
+	total().remove(bytes);
+	for_encoding(pixel_format).remove(bytes);
+}
+
+void bitmap_encoding_changed(encoding from, encoding to, size_t bytes)
+{
+	if (from != to)
+	{
+		for_encoding(from).remove(bytes);
+		for_encoding(to).add(bytes, false);
+	}
+}
+
+static v8::Handle<v8::Object> usage_info(v8::Isolate* isolate, memory_usage const& usage, memory_usage const* previous)
+{
+	v8::Local<v8::Object> o = v8::Object::New(isolate);
+	set_option(isolate, o, "bytes", static_cast<double>(usage.bytes));
+	set_option(isolate, o, "count", static_cast<double>(usage.count));
+	set_option(isolate, o, "peak_bytes", static_cast<double>(usage.peak_bytes));
+	set_option(isolate, o, "peak_count", static_cast<double>(usage.peak_count));
+	set_option(isolate, o, "allocations", static_cast<double>(usage.allocations));
+	set_option(isolate, o, "allocated_bytes", static_cast<double>(usage.allocated_bytes));
+	if (previous)
+	{
+		set_option(isolate, o, "allocation_rate", usage.allocation_rate(*previous));
+		set_option(isolate, o, "allocated_bytes_rate", usage.allocated_bytes_rate(*previous));
+	}
+	return o;
+}
+
+v8::Handle<v8::Value> get_info(v8::Isolate* isolate)
+{
+	v8::EscapableHandleScope scope(isolate);
+
+	registry& reg = registry::instance();
+	boost::mutex::scoped_lock lock(reg.mutex);
+
+	// report usage with the rates since the previous snapshot of the same name
+	auto report = [isolate, &reg](v8::Handle<v8::Object> target, std::string const& key, char const* name, memory_usage const& usage)
+	{
+		std::map<std::string, memory_usage>::iterator prev = reg.previous.find(key);
+		set_option(isolate, target, name, usage_info(isolate, usage, prev != reg.previous.end()? &prev->second : nullptr));
+		reg.previous[key] = usage;
+	};
+
+	v8::Local<v8::Object> o = v8::Object::New(isolate);
+	report(o, "total", "total", total().usage());
+
+	v8::Local<v8::Object> encodings_info = v8::Object::New(isolate);
+	for (size_t i = 0; i < encoding_count; ++i)
+	{
+		memory_usage const usage = for_encoding(encodings[i]).usage();
+		if (usage.peak_count)
+		{
+			char const* name = encoding_name(encodings[i]);
+			report(encodings_info, std::string("encoding:") + name, name, usage);
+		}
+	}
+	set_option(isolate, o, "encodings", encodings_info);
+
+	v8::Local<v8::Object> counters_info = v8::Object::New(isolate);
+	for (std::map<memory_counter const*, std::string>::const_iterator it = reg.counters.begin(); it != reg.counters.end(); ++it)
+	{
+		report(counters_info, "counter:" + it->second, it->second.c_str(), it->first->usage());
+	}
+	set_option(isolate, o, "counters", counters_info);
+
+	return scope.Escape(o);
+}
+
+} // namespace memory
+
+}} // aspect::image
@@ -0,0 +1,223 @@
+#include "image/output_device.hpp"
+
+#include <boost/thread/locks.hpp>
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+namespace aspect { namespace image {
+
+output_device::output_device(char const* name)
+	: device(name)
+	, frame_rate_(0)
+	, start_time_(0)
+	, running_(false)
+	, stop_(false)
+	, presented_frames_(0)
+	, repeated_frames_(0)
+	, late_frames_(0)
+	, early_frames_(0)
+	, dropped_output_frames_(0)
+	, skipped_ticks_(0)
+{
+}
+
+output_device::~output_device()
+{
+	_aspect_assert(!running_ && "aspect::image::output_device is not stopped by derived device");
+	stop();
+}
+
+bool output_device::start(double frame_rate, uint64_t start_time)
+{
+	if (running_ || frame_rate <= 0)
+	{
+		return false;
+	}
+
+	frame_rate_ = frame_rate;
+	start_time_ = start_time? start_time : monotonic_time() + static_cast<uint64_t>(1e9 / frame_rate);
+	last_frame_ = shared_bitmap_container();
+
+	stop_ = false;
+	running_ = true;
+	thread_ = boost::thread(&output_device::run, this);
+	return true;
+}
+
+void output_device::stop()
+{
+	stop_ = true;
+	if (thread_.joinable())
+	{
+		thread_.join();
+	}
+	running_ = false;
+
+	// producers waiting for a free slot drop their frames now
+	queue_not_full_.notify_all();
+}
+
+void output_device::schedule_output_frame(shared_bitmap_container const& frame)
+{
+	entry e = { frame, false };
+	e.frame.set_schedule_time(monotonic_time());
+
+	boost::unique_lock<boost::mutex> lock(queue_mutex_);
+	while (queue_.size() >= output_queue_capacity)
+	{
+		if (!running_)
+		{
+			++dropped_output_frames_;
+			return;
+		}
+		queue_not_full_.wait_for(lock, boost::chrono::milliseconds(10));
+	}
+	queue_.push_back(e);
+}
+
+void output_device::clear()
+{
+	boost::lock_guard<boost::mutex> lock(queue_mutex_);
+	queue_.clear();
+	queue_not_full_.notify_all();
+}
+
+size_t output_device::pending_frames() const
+{
+	boost::lock_guard<boost::mutex> lock(queue_mutex_);
+	return queue_.size();
+}
+
+output_device::output_stats output_device::get_output_stats() const
+{
+	output_stats stats;
+	stats.presented = presented_frames_;
+	stats.repeated = repeated_frames_;
+	stats.late = late_frames_;
+	stats.early = early_frames_;
+	stats.dropped = dropped_output_frames_;
+	stats.skipped_ticks = skipped_ticks_;
+	return stats;
+}
+
+// sleep till absolute time to not accumulate drift, in slices to see stop
+bool output_device::sleep_until(uint64_t time)
+{
+	typedef std::chrono::steady_clock clock;
+	uint64_t const slice = 10000000; // 10 ms
+
+	for (uint64_t now = monotonic_time(); now < time && !stop_; now = monotonic_time())
+	{
+		uint64_t const until = time - now > slice? now + slice : time;
+		std::this_thread::sleep_until(clock::time_point(std::chrono::duration_cast<clock::duration>(std::chrono::nanoseconds(until))));
+	}
+	return !stop_;
+}
+
+// take the latest frame due for tick at time
+bool output_device::next_frame(uint64_t time, shared_bitmap_container& frame)
+{
+	uint64_t const half_period = static_cast<uint64_t>(0.5e9 / frame_rate_);
+	bool found = false;
+
+	boost::lock_guard<boost::mutex> lock(queue_mutex_);
+	while (!queue_.empty())
+	{
+		entry& e = queue_.front();
+		uint64_t const presentation_time = e.frame.presentation_time();
+		if (presentation_time > time + half_period)
+		{
+			if (!e.early)
+			{
+				e.early = true;
+				++early_frames_;
+			}
+			break;
+		}
+		if (found)
+		{
+			if (presentation_time == 0)
+			{
+				break; // to present on the next tick
+			}
+			++dropped_output_frames_;
+		}
+		frame = e.frame;
+		found = true;
+		queue_.pop_front();
+		if (presentation_time == 0)
+		{
+			break;
+		}
+	}
+	if (found)
+	{
+		if (frame.presentation_time() && time > frame.presentation_time() + half_period)
+		{
+			++late_frames_;
+		}
+		queue_not_full_.notify_all();
+	}
+	return found;
+}
+
+void output_device::run()
+{
+	uint64_t tick = tick_at(monotonic_time());
+	if (tick_time(tick) < monotonic_time())
+	{
+		++tick;
+	}
+
+	for (; sleep_until(tick_time(tick)); ++tick)
+	{
+		uint64_t const now = monotonic_time();
+		uint64_t const current = tick_at(now);
+		if (current > tick)
+		{
+			skipped_ticks_ += current - tick;
+			tick = current;
+		}
+		uint64_t const time = tick_time(tick);
+		present_jitter_.record(now > time? now - time : 0);
+
+		shared_bitmap_container frame;
+		if (next_frame(time, frame))
+		{
+			present_frame(frame, tick, false);
+			output_frame_presented(frame);
+			last_frame_ = frame;
+			++presented_frames_;
+		}
+		else if (last_frame_.color())
+		{
+			present_frame(last_frame_, tick, true);
+			++repeated_frames_;
+		}
+	}
+}
+
+v8::Handle<v8::Value> output_device::get_info(v8::Isolate* isolate) const
+{
+	v8::Handle<v8::Value> info = device::get_info(isolate);
+	v8::Handle<v8::Object> o = info.As<v8::Object>();
+
+	output_stats const stats = get_output_stats();
+
+	set_option(isolate, o, "frame_rate", frame_rate_);
+	set_option(isolate, o, "running", is_running());
+	set_option(isolate, o, "pending_output_frames", static_cast<double>(pending_frames()));
+	set_option(isolate, o, "presented_frames", static_cast<double>(stats.presented));
+	set_option(isolate, o, "repeated_frames", static_cast<double>(stats.repeated));
+	set_option(isolate, o, "late_frames", static_cast<double>(stats.late));
+	set_option(isolate, o, "early_frames", static_cast<double>(stats.early));
+	set_option(isolate, o, "dropped_output_frames", static_cast<double>(stats.dropped));
+	set_option(isolate, o, "skipped_ticks", static_cast<double>(stats.skipped_ticks));
+	set_option(isolate, o, "present_jitter", present_jitter_.get_info(isolate));
+
+	return info;
+}
+
+}} // aspect::image
@@ -1,6 +1,14 @@
 #include "image/image.hpp"
 #include "image/quantizer.hpp"
 
+#include <algorithm>
+#include <chrono>
+#include <climits>
+#include <cmath>
+#include <queue>
+
+#include <boost/thread/thread.hpp>
+
 namespace aspect { namespace image {
 
 struct color24;
@@ -78,6 +86,24 @@ color32& color32::operator=(color24 const& src)
 	return *this;
 }
 
+/// Pixel reader with byte offsets of color channels, A < 0 for no alpha.
+/// Alpha is stored inverted, pixels without alpha are opaque 0.
+template<int R, int G, int B, int A, int BPP>
+struct pixel_layout
+{
+	static int const bpp = BPP;
+
+	static int r(uint8_t const* p) { return p[R]; }
+	static int g(uint8_t const* p) { return p[G]; }
+	static int b(uint8_t const* p) { return p[B]; }
+	static int a(uint8_t const* p) { return A < 0? 0 : p[A < 0? 0 : A]; }
+};
+
+typedef pixel_layout<0, 1, 2, 3, 4>  rgba8_layout;
+typedef pixel_layout<1, 2, 3, 0, 4>  argb8_layout;
+typedef pixel_layout<2, 1, 0, 3, 4>  bgra8_layout;
+typedef pixel_layout<0, 1, 2, -1, 3> rgb8_layout;
+
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////
@@ -117,6 +143,31 @@ struct rgb_box {
     int b0;  
     int b1;
     int vol;
+    int a;			 /* alpha bucket of the box */
+    int64_t wt;	 /* cached sums of the statistics over the box, see Moments() */
+    int64_t mr;
+    int64_t mg;
+    int64_t mb;
+    int64_t ma;
+    float m2;
+};
+
+/* Box index keyed by its variance, for the partition priority queue */
+struct box_variance {
+	size_t index;
+	float variance;
+
+	box_variance(size_t index, float variance)
+		: index(index), variance(variance)
+	{
+	}
+
+	/* the larger variance goes first, lower index wins a tie */
+	bool operator<(box_variance const& other) const
+	{
+		return variance < other.variance
+			|| (variance == other.variance && index > other.index);
+	}
 };
 
 /* Histogram is in elements 1..HISTSIZE along each axis,
@@ -124,12 +175,36 @@ struct rgb_box {
  * NB: these must start out 0!
  */
 
-typedef struct QuantizeContext {
+typedef struct Histogram {
 	float		gm2[33][33][33];
-	int			wt[33][33][33];
-	int			mr[33][33][33];
-	int			mg[33][33][33];
-	int			mb[33][33][33];
+	int64_t		wt[33][33][33];		// 64 bit sums do not overflow for large images
+	int64_t		mr[33][33][33];
+	int64_t		mg[33][33][33];
+	int64_t		mb[33][33][33];
+	int64_t		ma[33][33][33];
+} Histogram;
+
+/* In alpha mode pixels are split into alpha buckets with a histogram
+ * for each of them. Alpha is stored inverted: 0 is opaque and 255 is
+ * fully transparent in PNG terms. Both of them get own buckets, so they
+ * never share a palette entry with translucent pixels.
+ */
+static int const ALPHA_BUCKETS = 6;
+
+static inline int alpha_bucket(int a)
+{
+	return a == 0? 0 : (a == 255? ALPHA_BUCKETS - 1 : 1 + (a >> 6));
+}
+
+/* middle of the alpha bucket range */
+static inline int alpha_bucket_value(int bucket)
+{
+	return bucket == 0? 0 : (bucket == ALPHA_BUCKETS - 1? 255 : ((bucket - 1) << 6) + 32);
+}
+
+typedef struct QuantizeContext {
+	Histogram*	hist;			// histogram for each alpha bucket
+	int			buckets;		// number of histograms, 1 if alpha is not used
 //	SduColor**	ppcolor;		// Original image data
 //	color32	*pcolor32;
 //	color24 *pcolor24;
@@ -141,50 +216,65 @@ typedef struct QuantizeContext {
 	int			cy;				// Image height
 	int			stride;			// number of bytes between beginnings of lines
 	int			K;				// Desired number of colors
-	unsigned short* Qadd;		// The new image
+	int			step;			// sample one pixel in each step x step block
 } QuantizeContext;
 
 
-// build 3-D color histogram of counts, r/g/b, c^2
-static void Hist3d(int* vwt, int* vmr, int* vmg, int* vmb, float* m2, QuantizeContext* pqc) 
-{
-	 int ind, r, g, b;
-	int	     inr, ing, inb, table[256];
-	 long int i;
-
-	for(i=0; i<256; ++i) table[i]=i*i;
-	unsigned short* pqadd = pqc->Qadd;
-//	int size = pqc->cy*pqc->cx;
-	uint8_t const* pcolor = pqc->pcolor;
-	
-	for(int y = 0; y < pqc->cy; y++)
-	for(int x = 0; x < pqc->cx; x++)
-//	for(i = 0; i < iSize; ++i)
-//	for (i = 0; i<pqc->cy; ++i)
-	{
-//		SduColor* pcolor = pqc->ppcolor[i];
-//		for (long int j = 0; j < pqc->cx; ++j) {
-//			SduColor c = *pcolor++;
-			//GAPI_Color32 c = *pcolor++;
-
-		uint8_t const* src = pcolor+((y+pqc->top)*pqc->stride+(x+pqc->left)*4);
-
-		color24 *pc = (color24 *)src; //pcolor;
-//		pcolor += pqc->bpp;
-		    r = pc->r; g = pc->g; b = pc->b;
-			inr=(r>>3)+1; 
-			ing=(g>>3)+1; 
-			inb=(b>>3)+1; 
-			ind=(inr<<10)+(inr<<6)+inr+(ing<<5)+ing+inb;
-			*pqadd=(unsigned short)ind;
-			++pqadd;
-			/*[inr][ing][inb]*/
-			++vwt[ind];
-			vmr[ind] += r;
-			vmg[ind] += g;
-			vmb[ind] += b;
-   			m2[ind] += (float)(table[r]+table[g]+table[b]);
-//		}
+// add pixel to 3-D color histogram of its alpha bucket
+template<typename Layout>
+static inline void Hist3dAdd(QuantizeContext* pqc, uint8_t const* src, int const* table)
+{
+	int ind, r, g, b, a;
+	int inr, ing, inb;
+
+	r = Layout::r(src); g = Layout::g(src); b = Layout::b(src); a = Layout::a(src);
+	inr=(r>>3)+1; 
+	ing=(g>>3)+1; 
+	inb=(b>>3)+1; 
+	ind=(inr<<10)+(inr<<6)+inr+(ing<<5)+ing+inb;
+	/*[inr][ing][inb]*/
+	Histogram& h = pqc->hist[pqc->buckets > 1? alpha_bucket(a) : 0];
+	++(&h.wt[0][0][0])[ind];
+	(&h.mr[0][0][0])[ind] += r;
+	(&h.mg[0][0][0])[ind] += g;
+	(&h.mb[0][0][0])[ind] += b;
+	(&h.ma[0][0][0])[ind] += a;
+	(&h.gm2[0][0][0])[ind] += (float)(table[r]+table[g]+table[b]);
+}
+
+// build 3-D color histogram of counts, r/g/b/a, c^2 for each alpha bucket
+// from all pixels, or from a stratified sample with one pixel at
+// a pseudo-random position in each step x step block
+template<typename Layout>
+static void Hist3d(QuantizeContext* pqc)
+{
+	int table[256];
+	for (int i = 0; i < 256; ++i) table[i] = i*i;
+
+	uint8_t const* pcolor = pqc->pcolor + pqc->top * pqc->stride + pqc->left * Layout::bpp;
+	int const step = pqc->step;
+
+	if ( step <= 1 )
+	{
+		for (int y = 0; y < pqc->cy; ++y)
+		for (int x = 0; x < pqc->cx; ++x)
+		{
+			Hist3dAdd<Layout>(pqc, pcolor + y * pqc->stride + x * Layout::bpp, table);
+		}
+		return;
+	}
+
+	for (int y0 = 0; y0 < pqc->cy; y0 += step)
+	for (int x0 = 0; x0 < pqc->cx; x0 += step)
+	{
+		uint32_t hash = (uint32_t)x0 * 2654435761u ^ (uint32_t)y0 * 2246822519u;
+		hash ^= hash >> 15;
+		hash *= 2654435761u;
+		hash ^= hash >> 13;
+
+		int const y = y0 + (int)((hash & 0xffff) % (uint32_t)std::min(step, pqc->cy - y0));
+		int const x = x0 + (int)((hash >> 16) % (uint32_t)std::min(step, pqc->cx - x0));
+		Hist3dAdd<Layout>(pqc, pcolor + y * pqc->stride + x * Layout::bpp, table);
 	}
 }
 
@@ -202,21 +292,21 @@ static void Hist3d(int* vwt, int* vmr, int* vmg, int* vmb, float* m2, QuantizeCo
 
 
 /* compute cumulative moments. */
-static void M3d(int* vwt, int* vmr, int* vmg, int* vmb, float* m2) 
+static void M3d(int64_t* vwt, int64_t* vmr, int64_t* vmg, int64_t* vmb, int64_t* vma, float* m2) 
 {
 	 unsigned short int ind1, ind2;
 	 unsigned char i, r, g, b;
-	int line, line_r, line_g, line_b,
-		 area[33], area_r[33], area_g[33], area_b[33];
+	int64_t line, line_r, line_g, line_b, line_a,
+		 area[33], area_r[33], area_g[33], area_b[33], area_a[33];
 	float    line2, area2[33];
 
     for(r=1; r<=32; ++r){
 		for(i=0; i<=32; ++i) {
-			area[i]=area_r[i]=area_g[i]=area_b[i]=0;
+			area[i]=area_r[i]=area_g[i]=area_b[i]=area_a[i]=0;
 			area2[i]=(float)area[i];
 		}
 		for(g=1; g<=32; ++g){
-			line = line_r = line_g = line_b = 0;
+			line = line_r = line_g = line_b = line_a = 0;
 			line2 = (float)line;
 			for(b=1; b<=32; ++b){
 				ind1 = (unsigned short)((r<<10) + (r<<6) + r + (g<<5) + g + b); /* [r][g][b] */
@@ -224,17 +314,20 @@ static void M3d(int* vwt, int* vmr, int* vmg, int* vmb, float* m2)
 				line_r += vmr[ind1]; 
 				line_g += vmg[ind1]; 
 				line_b += vmb[ind1];
+				line_a += vma[ind1];
 				line2 += m2[ind1];
 				area[b] += line;
 				area_r[b] += line_r;
 				area_g[b] += line_g;
 				area_b[b] += line_b;
+				area_a[b] += line_a;
 				area2[b] += line2;
 				ind2 = (unsigned short)(ind1 - 1089); /* [r-1][g][b] */
 				vwt[ind1] = vwt[ind2] + area[b];
 				vmr[ind1] = vmr[ind2] + area_r[b];
 				vmg[ind1] = vmg[ind2] + area_g[b];
 				vmb[ind1] = vmb[ind2] + area_b[b];
+				vma[ind1] = vma[ind2] + area_a[b];
 				m2[ind1] = m2[ind2] + area2[b];
 			}
 		}
@@ -243,7 +336,7 @@ static void M3d(int* vwt, int* vmr, int* vmg, int* vmb, float* m2)
 
 
 /* Compute sum over a box of any given statistic */
-static long int Vol(rgb_box* cube, int mmt[33][33][33]) 
+static int64_t Vol(rgb_box* cube, int64_t mmt[33][33][33]) 
 {
     return( mmt[cube->r1][cube->g1][cube->b1] 
 	   -mmt[cube->r1][cube->g1][cube->b0]
@@ -255,6 +348,32 @@ static long int Vol(rgb_box* cube, int mmt[33][33][33])
 	   -mmt[cube->r0][cube->g0][cube->b0] );
 }
 
+static float Vol(rgb_box* cube, float mmt[33][33][33])
+{
+    return( mmt[cube->r1][cube->g1][cube->b1]
+	   -mmt[cube->r1][cube->g1][cube->b0]
+	   -mmt[cube->r1][cube->g0][cube->b1]
+	   +mmt[cube->r1][cube->g0][cube->b0]
+	   -mmt[cube->r0][cube->g1][cube->b1]
+	   +mmt[cube->r0][cube->g1][cube->b0]
+	   +mmt[cube->r0][cube->g0][cube->b1]
+	   -mmt[cube->r0][cube->g0][cube->b0] );
+}
+
+/* Cache sums of all the statistics over a box, so that Var() and Cut()
+ * don't need to look them up again while the box is in the queue.
+ */
+static void Moments(rgb_box* cube, QuantizeContext* pqc)
+{
+	Histogram& h = pqc->hist[cube->a];
+    cube->wt = Vol(cube, h.wt);
+    cube->mr = Vol(cube, h.mr);
+    cube->mg = Vol(cube, h.mg);
+    cube->mb = Vol(cube, h.mb);
+    cube->ma = Vol(cube, h.ma);
+    cube->m2 = Vol(cube, h.gm2);
+}
+
 /* The next two routines allow a slightly more efficient calculation
  * of Vol() for a proposed subbox of a given box.  The sum of Top()
  * and Bottom() is the Vol() of a subbox split in the given direction
@@ -263,7 +382,7 @@ static long int Vol(rgb_box* cube, int mmt[33][33][33])
 
 /* Compute part of Vol(cube, mmt) that doesn't depend on r1, g1, or b1 */
 /* (depending on dir) */
-static long int Bottom(rgb_box *cube, direction dir, int mmt[33][33][33])
+static int64_t Bottom(rgb_box *cube, direction dir, int64_t mmt[33][33][33])
 {
 	switch(dir)
 	{
@@ -289,7 +408,7 @@ static long int Bottom(rgb_box *cube, direction dir, int mmt[33][33][33])
 
 /* Compute remainder of Vol(cube, mmt), substituting pos for */
 /* r1, g1, or b1 (depending on dir) */
-static long int Top(rgb_box *cube, direction dir, int pos, int mmt[33][33][33])
+static int64_t Top(rgb_box *cube, direction dir, int pos, int64_t mmt[33][33][33])
 {
 	switch(dir)
 	{
@@ -313,25 +432,15 @@ static long int Top(rgb_box *cube, direction dir, int pos, int mmt[33][33][33])
 }
 
 
-/* Compute the weighted variance of a box */
+/* Compute the weighted variance of a box from its cached moments */
 /* NB: as with the raw statistics, this is really the variance * size */
-static float Var(rgb_box* cube, QuantizeContext* pqc)
+static float Var(rgb_box const* cube)
 {
-	float dr, dg, db, xx;
-
-    dr = (float)Vol(cube, pqc->mr); 
-    dg = (float)Vol(cube, pqc->mg); 
-    db = (float)Vol(cube, pqc->mb);
-    xx =  pqc->gm2[cube->r1][cube->g1][cube->b1] 
-		 -pqc->gm2[cube->r1][cube->g1][cube->b0]
-		 -pqc->gm2[cube->r1][cube->g0][cube->b1]
-		 +pqc->gm2[cube->r1][cube->g0][cube->b0]
-		 -pqc->gm2[cube->r0][cube->g1][cube->b1]
-		 +pqc->gm2[cube->r0][cube->g1][cube->b0]
-		 +pqc->gm2[cube->r0][cube->g0][cube->b1]
-		 -pqc->gm2[cube->r0][cube->g0][cube->b0];
+	float const dr = (float)cube->mr;
+	float const dg = (float)cube->mg;
+	float const db = (float)cube->mb;
 
-    return( xx - (dr*dr+dg*dg+db*db)/(float)Vol(cube,pqc->wt) );    
+    return( cube->m2 - (dr*dr+dg*dg+db*db)/(float)cube->wt );
 }
 
 /* We want to minimize the sum of the variances of two subboxes.
@@ -346,26 +455,28 @@ static float Maximize(
 	rgb_box *cube,
 	direction dir,
 	int first, int last, int *cut,
-	int whole_r, int whole_g, int whole_b, int whole_w,
+	int64_t whole_r, int64_t whole_g, int64_t whole_b, int64_t whole_w,
 	QuantizeContext* pqc
 )
 {
-	 int half_r, half_g, half_b, half_w;
-	int base_r, base_g, base_b, base_w;
+	 int64_t half_r, half_g, half_b, half_w;
+	int64_t base_r, base_g, base_b, base_w;
 	 int i;
 	 float temp, max;
 
-    base_r = Bottom(cube, dir, pqc->mr);
-    base_g = Bottom(cube, dir, pqc->mg);
-    base_b = Bottom(cube, dir, pqc->mb);
-    base_w = Bottom(cube, dir, pqc->wt);
+	Histogram& h = pqc->hist[cube->a];
+
+    base_r = Bottom(cube, dir, h.mr);
+    base_g = Bottom(cube, dir, h.mg);
+    base_b = Bottom(cube, dir, h.mb);
+    base_w = Bottom(cube, dir, h.wt);
     max = 0.0;
     *cut = -1;
     for(i=first; i<last; ++i){
-	half_r = base_r + Top(cube, dir, i, pqc->mr);
-	half_g = base_g + Top(cube, dir, i, pqc->mg);
-	half_b = base_b + Top(cube, dir, i, pqc->mb);
-	half_w = base_w + Top(cube, dir, i, pqc->wt);
+	half_r = base_r + Top(cube, dir, i, h.mr);
+	half_g = base_g + Top(cube, dir, i, h.mg);
+	half_b = base_b + Top(cube, dir, i, h.mb);
+	half_w = base_w + Top(cube, dir, i, h.wt);
         /* now half_x is sum over lower half of box, if split at i */
         if (half_w == 0) {      /* subbox could be empty of pixels! */
           continue;             /* never split into an empty box */
@@ -393,12 +504,13 @@ static int Cut(rgb_box *set1, rgb_box *set2, QuantizeContext* pqc)
 	direction dir;
 	int cutr, cutg, cutb;
 	float maxr, maxg, maxb;
-	int whole_r, whole_g, whole_b, whole_w;
+	int64_t whole_r, whole_g, whole_b, whole_w, whole_a;
 
-    whole_r = Vol(set1, pqc->mr);
-    whole_g = Vol(set1, pqc->mg);
-    whole_b = Vol(set1, pqc->mb);
-    whole_w = Vol(set1, pqc->wt);
+    whole_r = set1->mr;
+    whole_g = set1->mg;
+    whole_b = set1->mb;
+    whole_w = set1->wt;
+    whole_a = set1->ma;
 
     maxr = Maximize(set1, RED, set1->r0+1, set1->r1, &cutr,
 		    whole_r, whole_g, whole_b, whole_w, pqc);
@@ -420,6 +532,7 @@ static int Cut(rgb_box *set1, rgb_box *set2, QuantizeContext* pqc)
     set2->r1 = set1->r1;
     set2->g1 = set1->g1;
     set2->b1 = set1->b1;
+    set2->a = set1->a;
 
     switch (dir){
 		case RED:
@@ -440,34 +553,286 @@ static int Cut(rgb_box *set1, rgb_box *set2, QuantizeContext* pqc)
     }
     set1->vol=(set1->r1-set1->r0)*(set1->g1-set1->g0)*(set1->b1-set1->b0);
     set2->vol=(set2->r1-set2->r0)*(set2->g1-set2->g0)*(set2->b1-set2->b0);
+
+    /* the second box gets the remainder of the whole one */
+    Moments(set1, pqc);
+    set2->wt = whole_w - set1->wt;
+    set2->mr = whole_r - set1->mr;
+    set2->mg = whole_g - set1->mg;
+    set2->mb = whole_b - set1->mb;
+    set2->ma = whole_a - set1->ma;
+    set2->m2 = Vol(set2, pqc->hist[set2->a].gm2);
     return 1;
 }
 
 
-static void Mark(rgb_box *cube, int label, unsigned char *tag)
+// inverse colormap has a cell for each 5 bit per channel color
+static int const INVERSE_BITS = 5;
+static int const INVERSE_SIZE = 1 << INVERSE_BITS;
+
+static inline size_t inverse_cell(int r, int g, int b)
 {
-	 int r, g, b;
+	int const shift = 8 - INVERSE_BITS;
+	return ((r >> shift) << (2 * INVERSE_BITS)) | ((g >> shift) << INVERSE_BITS) | (b >> shift);
+}
 
-	for(r=cube->r0+1; r<=cube->r1; ++r)
-		for(g=cube->g0+1; g<=cube->g1; ++g)
-			for(b=cube->b0+1; b<=cube->b1; ++b)
-				tag[(r<<10) + (r<<6) + r + (g<<5) + g + b] = (unsigned char)label;
+// offset of the pixel alpha bucket in the inverse colormap
+template<typename Layout>
+static inline size_t inverse_offset(bool alpha, uint8_t const* src)
+{
+	return alpha? alpha_bucket(Layout::a(src)) * (INVERSE_SIZE * INVERSE_SIZE * INVERSE_SIZE) : 0;
+}
+
+static inline int clamp_color(int c)
+{
+	return c < 0? 0 : (c > 255? 255 : c);
+}
+
+// 4x4 Bayer matrix for ordered dithering, thresholds in [0..15]
+static int const bayer4[4][4] =
+{
+	{  0,  8,  2, 10 },
+	{ 12,  4, 14,  6 },
+	{  3, 11,  1,  9 },
+	{ 15,  7, 13,  5 },
+};
+
+// palette entries sorted by green, to limit the nearest color search
+// with the green distance
+typedef std::vector<std::pair<int, uint8_t>> green_entries;
+
+// nearest palette entry to the color, alpha is compared only if ca >= 0
+template<typename Palette>
+static uint8_t nearest_entry(Palette const* palette, green_entries const& entries,
+	int cr, int cg, int cb, int ca)
+{
+	size_t const start = std::lower_bound(entries.begin(), entries.end(),
+		std::make_pair(cg, uint8_t(0))) - entries.begin();
+
+	int best = entries.empty()? 0 : entries[std::min(start, entries.size() - 1)].second;
+	int best_dist = INT_MAX;
+	for (size_t i = start; i < entries.size(); ++i)
+	{
+		int const dg = entries[i].first - cg;
+		if ( dg * dg >= best_dist ) break;
+
+		uint8_t const k = entries[i].second;
+		int const dr = palette[k].r - cr;
+		int const db = palette[k].b - cb;
+		int const da = ca < 0? 0 : palette[k].a - ca;
+		int const dist = dr * dr + dg * dg + db * db + da * da;
+		if ( dist < best_dist ) { best_dist = dist; best = k; }
+	}
+	for (size_t i = start; i-- > 0; )
+	{
+		int const dg = entries[i].first - cg;
+		if ( dg * dg >= best_dist ) break;
+
+		uint8_t const k = entries[i].second;
+		int const dr = palette[k].r - cr;
+		int const db = palette[k].b - cb;
+		int const da = ca < 0? 0 : palette[k].a - ca;
+		int const dist = dr * dr + dg * dg + db * db + da * da;
+		if ( dist < best_dist ) { best_dist = dist; best = k; }
+	}
+	return static_cast<uint8_t>(best);
+}
+
+/* Histogram cell with pixel sums, input of the k-means palette refinement */
+struct HistCell {
+	int64_t wt, mr, mg, mb, ma;
+	int a;			/* alpha bucket of the cell */
+};
+
+/* collect non-empty cells of the histograms, before M3d() makes them cumulative */
+static void HistCells(QuantizeContext* pqc, std::vector<HistCell>& cells)
+{
+	for (int a = 0; a < pqc->buckets; ++a)
+	{
+		Histogram const& h = pqc->hist[a];
+		int64_t const* vwt = &h.wt[0][0][0];
+		for (int ind = 0; ind < 33 * 33 * 33; ++ind)
+		{
+			if ( vwt[ind] )
+			{
+				HistCell const cell = { vwt[ind], (&h.mr[0][0][0])[ind], (&h.mg[0][0][0])[ind],
+					(&h.mb[0][0][0])[ind], (&h.ma[0][0][0])[ind], a };
+				cells.push_back(cell);
+			}
+		}
+	}
+}
+
+/* weighted sums of the cells assigned to a palette entry */
+struct CentroidSums {
+	double wt, r, g, b, a;
+};
+
+/* assign cells to the nearest palette entry of their alpha bucket */
+template<typename Palette>
+static void KMeansAssign(Palette const* palette, std::vector<green_entries> const& by_green,
+	green_entries const& all, HistCell const* begin, HistCell const* end, CentroidSums* sums)
+{
+	for (HistCell const* cell = begin; cell != end; ++cell)
+	{
+		double const wt = static_cast<double>(cell->wt);
+		int const r = static_cast<int>(cell->mr / cell->wt);
+		int const g = static_cast<int>(cell->mg / cell->wt);
+		int const b = static_cast<int>(cell->mb / cell->wt);
+
+		bool const own = !by_green[cell->a].empty();
+		uint8_t const k = nearest_entry(palette, own? by_green[cell->a] : all,
+			r, g, b, own? -1 : static_cast<int>(cell->ma / cell->wt));
+
+		CentroidSums& s = sums[k];
+		s.wt += wt;
+		s.r += static_cast<double>(cell->mr);
+		s.g += static_cast<double>(cell->mg);
+		s.b += static_cast<double>(cell->mb);
+		s.a += static_cast<double>(cell->ma);
+	}
+}
+
+/* Refine palette with k-means iterations over the histogram cells
+ * in parallel, until no entry moves, or the time budget is over
+ */
+template<typename Palette>
+static void KMeans(Palette* palette, size_t size, std::vector<HistCell> const& cells,
+	bool alpha, size_t iterations, double time_budget_ms)
+{
+	typedef std::chrono::steady_clock clock;
+	clock::time_point const start = clock::now();
+
+	// at least 4K cells for a thread
+	size_t const threads = std::max<size_t>(1,
+		std::min<size_t>(boost::thread::hardware_concurrency(), cells.size() / 4096));
+	size_t const chunk = (cells.size() + threads - 1) / threads;
+
+	std::vector<CentroidSums> sums(threads * size);
+	for (size_t iteration = 0; iteration < iterations; ++iteration)
+	{
+		std::vector<green_entries> by_green(alpha? ALPHA_BUCKETS : 1);
+		green_entries all(size);
+		for (size_t k = 0; k < size; ++k)
+		{
+			all[k] = std::make_pair(static_cast<int>(palette[k].g), static_cast<uint8_t>(k));
+			by_green[alpha? alpha_bucket(palette[k].a) : 0].push_back(all[k]);
+		}
+		std::sort(all.begin(), all.end());
+		for (size_t a = 0; a < by_green.size(); ++a)
+		{
+			std::sort(by_green[a].begin(), by_green[a].end());
+		}
+
+		std::fill(sums.begin(), sums.end(), CentroidSums());
+		boost::thread_group workers;
+		for (size_t t = 1; t < threads; ++t)
+		{
+			HistCell const* begin = &cells[0] + std::min(cells.size(), t * chunk);
+			HistCell const* end = &cells[0] + std::min(cells.size(), (t + 1) * chunk);
+			CentroidSums* thread_sums = &sums[t * size];
+			workers.create_thread([&, begin, end, thread_sums]()
+			{
+				KMeansAssign(palette, by_green, all, begin, end, thread_sums);
+			});
+		}
+		KMeansAssign(palette, by_green, all, &cells[0], &cells[0] + std::min(cells.size(), chunk), &sums[0]);
+		workers.join_all();
+
+		// move entries to the centroids of their cells
+		bool moved = false;
+		for (size_t k = 0; k < size; ++k)
+		{
+			CentroidSums s = sums[k];
+			for (size_t t = 1; t < threads; ++t)
+			{
+				CentroidSums const& st = sums[t * size + k];
+				s.wt += st.wt; s.r += st.r; s.g += st.g; s.b += st.b; s.a += st.a;
+			}
+			if ( s.wt == 0 ) continue;
+
+			uint8_t const r = static_cast<uint8_t>(s.r / s.wt + 0.5);
+			uint8_t const g = static_cast<uint8_t>(s.g / s.wt + 0.5);
+			uint8_t const b = static_cast<uint8_t>(s.b / s.wt + 0.5);
+			uint8_t const a = alpha? static_cast<uint8_t>(s.a / s.wt + 0.5) : palette[k].a;
+			moved = moved || r != palette[k].r || g != palette[k].g || b != palette[k].b || a != palette[k].a;
+			palette[k].r = r; palette[k].g = g; palette[k].b = b; palette[k].a = a;
+		}
+
+		if ( !moved ) break;
+		if ( time_budget_ms > 0
+			&& std::chrono::duration<double, std::milli>(clock::now() - start).count() >= time_budget_ms )
+		{
+			break;
+		}
+	}
 }
 
 ///////////////////////////////////////////////////////////////////////////
 //
 // aspect::quantizer
 //
-void quantizer::quantize(uint8_t const* pixels, size_t stride, image_rect const& rect, size_t num_colors)
+void quantizer::quantize(uint8_t const* pixels, size_t stride, image_rect const& rect, size_t num_colors, encoding pixel_format)
+{
+	build_palette(pixels, stride, rect, num_colors, pixel_format);
+
+	result_data_.resize(rect.width * rect.height);
+	map(pixels, stride, rect, &result_data_[0], rect.width, pixel_format);
+}
+
+void quantizer::build_palette(uint8_t const* pixels, size_t stride, image_rect const& rect, size_t num_colors, encoding pixel_format)
+{
+	// keep the previous palette while it is good enough for the new pixels
+	palette_reused_ = false;
+	palette_error_ = 0.0f;
+	if ( reuse_error_ > 0.0f && lut_size_ > 0 && num_colors == palette_colors_
+		&& inverse_map_.size() == inverse_map_size() )
+	{
+		palette_error_ = palette_error(pixels, stride, rect, pixel_format);
+		palette_reused_ = (palette_error_ <= reuse_error_);
+	}
+
+	if ( !palette_reused_ )
+	{
+		create_palette(pixels, stride, rect, num_colors, pixel_format);
+	}
+}
+
+void quantizer::map(uint8_t const* pixels, size_t stride, image_rect const& rect,
+	uint8_t* dst, size_t dst_stride, encoding pixel_format)
 {
+	_aspect_assert(lut_size_ > 0 && inverse_map_.size() == inverse_map_size());
+
+	size_t const bpp = bitmap::bytes_per_pixel(pixel_format);
+	begin_map(rect.width, pixel_format);
+	for (int y = 0; y < rect.height; ++y)
+	{
+		map_row(pixels + (rect.top + y) * stride + rect.left * bpp, dst + y * dst_stride);
+	}
+}
+
+void quantizer::create_palette(uint8_t const* pixels, size_t stride, image_rect const& rect,
+	size_t num_colors, encoding pixel_format)
+{
+	palette_colors_ = num_colors;
+
 	if ( num_colors >= MAXCOLOR )
 	{
 		num_colors = MAXCOLOR - 1;
 	}
+	// palette entries are addressed with a byte in the result data
+	if ( num_colors > max_lut_size )
+	{
+		num_colors = max_lut_size;
+	}
+	if ( num_colors == 0 )
+	{
+		num_colors = 1;
+	}
 
 	QuantizeContext qc = {};
 	qc.pcolor = pixels; //tx.get_data(); //pData; //ppGetData();
-	qc.bpp = 4; // tx.get_bpp();
+	qc.bpp = static_cast<int>(bitmap::bytes_per_pixel(pixel_format));
 	// we don't support other color depths
 	assert(qc.bpp == 4 || qc.bpp == 3);
 	qc.stride = static_cast<int>(stride);
@@ -476,72 +841,120 @@ void quantizer::quantize(uint8_t const* pixels, size_t stride, image_rect const&
 	qc.cx = rect.width; //tx.get_width();//iWidth;//iGetWidth();
 	qc.cy = rect.height; //tx.get_height(); //iHeight;//iGetHeight();
 	qc.K = static_cast<int>(num_colors);
+	qc.buckets = alpha_? ALPHA_BUCKETS : 1;
+	qc.step = 1;
+	double const pixel_count = static_cast<double>(rect.width) * rect.height;
+	if ( sample_size_ > 0 && pixel_count > sample_size_ )
+	{
+		qc.step = static_cast<int>(std::ceil(std::sqrt(pixel_count / sample_size_)));
+	}
 
-	std::vector<uint16_t> Qadd(qc.cx * qc.cy);
-	qc.Qadd = &Qadd[0];
+	std::vector<Histogram> hist(qc.buckets);
+	qc.hist = &hist[0];
 
-	Hist3d((int*)qc.wt, (int*)qc.mr, (int*)qc.mg, (int*)qc.mb, (float*)qc.gm2, &qc);
+	switch (pixel_format)
+	{
+	case RGBA8: Hist3d<rgba8_layout>(&qc); break;
+	case ARGB8: Hist3d<argb8_layout>(&qc); break;
+	case BGRA8: Hist3d<bgra8_layout>(&qc); break;
+	case RGB8:  Hist3d<rgb8_layout>(&qc);  break;
+	default:
+		_aspect_assert(false && "unsupported pixel format");
+		break;
+	}
 	//printf("Histogram done\n");
 	//free(Ig); free(Ib); free(Ir);
 
-	M3d((int*)qc.wt, (int*)qc.mr, (int*)qc.mg, (int*)qc.mb, (float*)qc.gm2);
+	std::vector<HistCell> cells;
+	if ( refine_iterations_ > 0 )
+	{
+		HistCells(&qc, cells);
+	}
+
+	for (int a = 0; a < qc.buckets; ++a)
+	{
+		Histogram& h = hist[a];
+		M3d((int64_t*)h.wt, (int64_t*)h.mr, (int64_t*)h.mg, (int64_t*)h.mb, (int64_t*)h.ma, (float*)h.gm2);
+	}
 	//printf("Moments done\n");
 
-	rgb_box cube[MAXCOLOR];
-	cube[0].r0 = cube[0].g0 = cube[0].b0 = 0;
-	cube[0].r1 = cube[0].g1 = cube[0].b1 = 32;
-	size_t next = 0;
-	float vv[MAXCOLOR];
-	for (size_t i = 1; i < num_colors; ++i)
+	// start with a whole box for each non-empty alpha bucket,
+	// the heaviest ones if there are more buckets than colors
+	std::vector<rgb_box> cube;
+	for (int a = 0; a < qc.buckets; ++a)
 	{
-		if ( Cut(&cube[next], &cube[i], &qc) )
+		rgb_box box = {};
+		box.r1 = box.g1 = box.b1 = 32;
+		box.vol = 32 * 32 * 32;
+		box.a = a;
+		Moments(&box, &qc);
+		if ( box.wt || (a == qc.buckets - 1 && cube.empty()) )
 		{
-			/* volume test ensures we won't try to cut one-cell box */
-			vv[next] = (cube[next].vol>1) ? Var(&cube[next], &qc) : 0.0f;
-			vv[i] = (cube[i].vol>1) ? Var(&cube[i], &qc) : 0.0f;
-		}
-		else
-		{
-			vv[next] = 0.0;   /* don't try to split this box again */
-			i--;              /* didn't create box i */
+			cube.push_back(box);
 		}
-		next = 0;
-		float max = vv[0];
-		for (size_t k = 1; k <= i; ++k)
+	}
+	if ( cube.size() > num_colors )
+	{
+		std::stable_sort(cube.begin(), cube.end(),
+			[](rgb_box const& b1, rgb_box const& b2) { return b1.wt > b2.wt; });
+	}
+	size_t count = std::min(cube.size(), num_colors);
+	cube.resize(num_colors);
+
+	// split the box with the largest variance first, boxes with zero
+	// variance are not queued since there is no point to split them
+	std::vector<box_variance> heap;
+	heap.reserve(num_colors);
+	std::priority_queue<box_variance> queue(std::less<box_variance>(), std::move(heap));
+	for (size_t k = 0; k < count; ++k)
+	{
+		float const v = Var(&cube[k]);
+		if ( v > 0.0f )
 		{
-			if ( vv[k] > max )
-			{
-				max = vv[k]; next = k;
-			}
+			queue.push(box_variance(k, v));
 		}
-		if (max <= 0.0 )
+	}
+
+	while ( count < num_colors && !queue.empty() )
+	{
+		size_t const next = queue.top().index;
+		queue.pop();
+
+		if ( Cut(&cube[next], &cube[count], &qc) )
 		{
-			num_colors = i + 1;
-//			fprintf(stderr, "Only got %d boxes\n", iNumColors);
-			break;
+			/* volume test ensures we won't try to cut one-cell box */
+			float const v1 = (cube[next].vol > 1) ? Var(&cube[next]) : 0.0f;
+			float const v2 = (cube[count].vol > 1) ? Var(&cube[count]) : 0.0f;
+			if ( v1 > 0.0f ) queue.push(box_variance(next, v1));
+			if ( v2 > 0.0f ) queue.push(box_variance(count, v2));
+			++count;
 		}
+		/* else don't try to split this box again */
 	}
+	num_colors = count;
 //	printf("Partition done\n");
 
-	/* the space for array gm2 can be freed now */
-
 	memset(&lut_, 0, sizeof(lut_));
-	std::vector<uint8_t> tag(33*33*33);
+
+	// palette entries are ordered by decreasing stored alpha bucket, so the
+	// opaque ones with stored alpha 0 are last and omitted from PNG tRNS
+	std::stable_sort(cube.begin(), cube.begin() + num_colors,
+		[](rgb_box const& b1, rgb_box const& b2) { return b1.a > b2.a; });
 
 	for (size_t k = 0; k < num_colors; ++k)
 	{
-		Mark(&cube[k], static_cast<int>(k), &tag[0]);
-		long const weight = Vol(&cube[k], qc.wt);
+		int64_t const weight = cube[k].wt;
 		if ( weight )
 		{
-			uint8_t const r = (uint8_t)(Vol(&cube[k], qc.mr) / weight);
-			uint8_t const g = (uint8_t)(Vol(&cube[k], qc.mg) / weight);
-			uint8_t const b = (uint8_t)(Vol(&cube[k], qc.mb) / weight);
+			uint8_t const r = (uint8_t)(cube[k].mr / weight);
+			uint8_t const g = (uint8_t)(cube[k].mg / weight);
+			uint8_t const b = (uint8_t)(cube[k].mb / weight);
+			uint8_t const a = alpha_? (uint8_t)(cube[k].ma / weight) : 0; // opaque
 
 			lut_.rgb[k].r = lut_.rgba[k].r = r;
 			lut_.rgb[k].g = lut_.rgba[k].g = g;
 			lut_.rgb[k].b = lut_.rgba[k].b = b;
-			lut_.rgba[k].a = 255;
+			lut_.rgba[k].a = a;
 		}
 		else
 		{
@@ -549,43 +962,209 @@ void quantizer::quantize(uint8_t const* pixels, size_t stride, image_rect const&
 			lut_.rgba[k].r = lut_.rgba[k].g = lut_.rgba[k].b = lut_.rgba[k].a = 0;
 		}
 	}
-//	      fprintf(stderr, "bogus box %d\n", k);
+	lut_size_ = num_colors;
+
+	if ( refine_iterations_ > 0 && !cells.empty() )
+	{
+		KMeans(lut_.rgba, lut_size_, cells, alpha_, refine_iterations_, refine_time_budget_);
+		for (size_t k = 0; k < lut_size_; ++k)
+		{
+			lut_.rgb[k].r = lut_.rgba[k].r;
+			lut_.rgb[k].g = lut_.rgba[k].g;
+			lut_.rgb[k].b = lut_.rgba[k].b;
+		}
+	}
 
+	build_inverse_map();
+}
+
+float quantizer::palette_error(uint8_t const* pixels, size_t stride, image_rect const& rect, encoding pixel_format) const
+{
+	switch (pixel_format)
+	{
+	case RGBA8: return sample_error<rgba8_layout>(pixels, stride, rect);
+	case ARGB8: return sample_error<argb8_layout>(pixels, stride, rect);
+	case BGRA8: return sample_error<bgra8_layout>(pixels, stride, rect);
+	case RGB8:  return sample_error<rgb8_layout>(pixels, stride, rect);
+	default:
+		_aspect_assert(false && "unsupported pixel format");
+		return 0.0f;
+	}
+}
 
-	/* output lut_r, lut_g, lut_b as color look-up table contents,
-	   Qadd as the quantized image (array of table addresses). */
+template<typename Layout>
+float quantizer::sample_error(uint8_t const* pixels, size_t stride, image_rect const& rect) const
+{
+	// measure on a regular grid of about 16K pixels
+	int const step = std::max(1, static_cast<int>(std::sqrt(rect.width * rect.height / 16384.0)));
 
-	size_t const size = rect.width * rect.height; //iWidth * iHeight;
-	result_data_.resize(size);
-//	if(tx.bpp == 4)
+	double error = 0;
+	size_t count = 0;
+	for (int y = step / 2; y < rect.height; y += step)
 	{
-		for (size_t i = 0; i < size; ++i)
+		uint8_t const* row = pixels + (rect.top + y) * stride + rect.left * Layout::bpp;
+		for (int x = step / 2; x < rect.width; x += step)
 		{
-			result_data_[i] = tag[qc.Qadd[i]];
+			uint8_t const* src = row + x * Layout::bpp;
+			int const r = Layout::r(src), g = Layout::g(src), b = Layout::b(src), a = Layout::a(src);
+			uint8_t const k = inverse_map_[inverse_offset<Layout>(alpha_, src) + inverse_cell(r, g, b)];
+
+			int const dr = r - lut_.rgba[k].r;
+			int const dg = g - lut_.rgba[k].g;
+			int const db = b - lut_.rgba[k].b;
+			int const da = alpha_? a - lut_.rgba[k].a : 0;
+			error += dr * dr + dg * dg + db * db + da * da;
+			++count;
 		}
 	}
-// 		else
-// 		if(tx.bpp == 3)
-// 		{
-// 			color24 *pcolor24 = tx.get_data_24();
-// 			for(i = 0; i < iSize; ++i)
-// 			{
-// 				int iIndex = tag[*pqadd++];
-// 				*pcolor24++ = color24(lut_r[iIndex], lut_g[iIndex], lut_b[iIndex]);
-// 			}
-// 		}
-/*
-	for (i = 0; i < iGetHeight(); ++i) {
-	SduColor* pcolor = ppGetData()[i];
-	for (int j = 0; j < iGetWidth(); ++j) {
-		int iIndex = tag[*pqadd++];
-		int a = pcolor->a;
-		*pcolor++ = SduColor(lut_r[iIndex], lut_g[iIndex], lut_b[iIndex], a);
-	}
-*/
-	//}
+	return count? static_cast<float>(error / count) : 0.0f;
+}
 
-	lut_size_ = num_colors;
+size_t quantizer::inverse_map_size() const
+{
+	return (alpha_? ALPHA_BUCKETS : 1) * INVERSE_SIZE * INVERSE_SIZE * INVERSE_SIZE;
+}
+
+void quantizer::build_inverse_map()
+{
+	int const buckets = alpha_? ALPHA_BUCKETS : 1;
+	size_t const cells = INVERSE_SIZE * INVERSE_SIZE * INVERSE_SIZE;
+	_aspect_assert(buckets * cells == inverse_map_size());
+
+	// entries are searched in own alpha bucket only
+	std::vector<green_entries> by_green(buckets);
+	green_entries all(lut_size_);
+	for (size_t k = 0; k < lut_size_; ++k)
+	{
+		all[k] = std::make_pair(lut_.rgba[k].g, static_cast<uint8_t>(k));
+		by_green[alpha_? alpha_bucket(lut_.rgba[k].a) : 0].push_back(all[k]);
+	}
+	std::sort(all.begin(), all.end());
+	for (int a = 0; a < buckets; ++a)
+	{
+		std::sort(by_green[a].begin(), by_green[a].end());
+	}
+
+	inverse_map_.resize(buckets * cells);
+
+	int const shift = 8 - INVERSE_BITS;
+	int const half = 1 << (shift - 1);
+	for (int a = 0; a < buckets; ++a)
+	{
+		// a bucket without palette entries uses the nearest color with alpha
+		bool const own = !by_green[a].empty();
+		green_entries const& entries = own? by_green[a] : all;
+		int const ca = own? -1 : alpha_bucket_value(a);
+
+		uint8_t* map = &inverse_map_[a * cells];
+		for (int r = 0; r < INVERSE_SIZE; ++r)
+		for (int g = 0; g < INVERSE_SIZE; ++g)
+		for (int b = 0; b < INVERSE_SIZE; ++b)
+		{
+			// cell centers
+			int const cr = (r << shift) + half;
+			int const cg = (g << shift) + half;
+			int const cb = (b << shift) + half;
+
+			*map++ = nearest_entry(lut_.rgba, entries, cr, cg, cb, ca);
+		}
+	}
+
+	// spread of ordered dither thresholds is about the distance
+	// between palette colors
+	ordered_spread_ = static_cast<int>(256.0 / std::max(1.0, std::cbrt(static_cast<double>(lut_size_))));
+	ordered_spread_ = std::min(std::max(ordered_spread_, 8), 64);
+}
+
+void quantizer::begin_map(size_t width, encoding pixel_format)
+{
+	map_width_ = width;
+	map_row_ = 0;
+	map_format_ = pixel_format;
+	if ( dither_ == DITHER_FLOYD_STEINBERG )
+	{
+		// two rows of r,g,b errors with a guard pixel on each side
+		errors_.assign((width + 2) * 3 * 2, 0);
+	}
+}
+
+void quantizer::map_row(uint8_t const* src, uint8_t* dst)
+{
+	switch (map_format_)
+	{
+	case RGBA8: map_pixels<rgba8_layout>(src, dst); break;
+	case ARGB8: map_pixels<argb8_layout>(src, dst); break;
+	case BGRA8: map_pixels<bgra8_layout>(src, dst); break;
+	case RGB8:  map_pixels<rgb8_layout>(src, dst);  break;
+	default:
+		_aspect_assert(false && "unsupported pixel format");
+		break;
+	}
+	++map_row_;
+}
+
+template<typename Layout>
+void quantizer::map_pixels(uint8_t const* src, uint8_t* dst)
+{
+	size_t const width = map_width_;
+	uint8_t const* const map = &inverse_map_[0];
+	bool const alpha = alpha_;
+
+	switch (dither_)
+	{
+	case DITHER_NONE:
+		for (size_t x = 0; x < width; ++x, src += Layout::bpp)
+		{
+			dst[x] = map[inverse_offset<Layout>(alpha, src) + inverse_cell(Layout::r(src), Layout::g(src), Layout::b(src))];
+		}
+		break;
+	case DITHER_ORDERED:
+		{
+			int const* const thresholds = bayer4[map_row_ & 3];
+			for (size_t x = 0; x < width; ++x, src += Layout::bpp)
+			{
+				int const d = (thresholds[x & 3] * 2 - 15) * ordered_spread_ / 32;
+				dst[x] = map[inverse_offset<Layout>(alpha, src) + inverse_cell(clamp_color(Layout::r(src) + d),
+					clamp_color(Layout::g(src) + d), clamp_color(Layout::b(src) + d))];
+			}
+		}
+		break;
+	case DITHER_FLOYD_STEINBERG:
+		{
+			// errors are in 1/16 units, rows are swapped on each line
+			// and scanned in alternating directions (serpentine)
+			int* cur = &errors_[(map_row_ & 1) * (width + 2) * 3];
+			int* next = &errors_[((map_row_ + 1) & 1) * (width + 2) * 3];
+			std::fill(next, next + (width + 2) * 3, 0);
+
+			bool const reverse = (map_row_ & 1) != 0;
+			int const dir = reverse? -1 : 1;
+			for (size_t i = 0; i < width; ++i)
+			{
+				size_t const x = reverse? width - 1 - i : i;
+				uint8_t const* const pc = src + x * Layout::bpp;
+				int* const e = cur + (x + 1) * 3;
+				int* const en = next + (x + 1) * 3;
+
+				int const r = clamp_color(Layout::r(pc) + (e[0] + 8) / 16);
+				int const g = clamp_color(Layout::g(pc) + (e[1] + 8) / 16);
+				int const b = clamp_color(Layout::b(pc) + (e[2] + 8) / 16);
+
+				uint8_t const k = map[inverse_offset<Layout>(alpha, pc) + inverse_cell(r, g, b)];
+				dst[x] = k;
+
+				int const err[3] = { r - lut_.rgb[k].r, g - lut_.rgb[k].g, b - lut_.rgb[k].b };
+				for (int c = 0; c < 3; ++c)
+				{
+					e[dir * 3 + c]  += err[c] * 7;
+					en[-dir * 3 + c] += err[c] * 3;
+					en[c]           += err[c] * 5;
+					en[dir * 3 + c] += err[c];
+				}
+			}
+		}
+		break;
+	}
 }
 
 }} // aspect::image
@@ -0,0 +1,528 @@
+#include "image/raw_file.hpp"
+
+#include <boost/make_shared.hpp>
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#ifndef O_DIRECT
+#define O_DIRECT 0
+#endif
+
+namespace aspect { namespace image {
+
+static char const raw_file_magic[8] = { 'I', 'M', 'G', 'R', 'A', 'W', 'F', 'R' };
+
+static inline uint64_t round_up(uint64_t value, uint64_t alignment)
+{
+	return (value + alignment - 1) / alignment * alignment;
+}
+
+void raw_file_header::init(image_size const& size, encoding pixel_format, size_t row_alignment, double frame_rate)
+{
+	memset(this, 0, sizeof(*this));
+	memcpy(magic, raw_file_magic, sizeof(magic));
+	version = current_version;
+	header_size = page_size;
+	width = size.width;
+	height = size.height;
+	this->pixel_format = pixel_format;
+	this->row_alignment = static_cast<uint32_t>(row_alignment);
+
+	plane_layout planes[bitmap::max_planes];
+	frame_size = bitmap::get_layout(size, pixel_format, planes, row_alignment);
+	frame_stride = round_up(frame_size, page_size);
+	frame_count = 0;
+	this->frame_rate = frame_rate;
+}
+
+bool raw_file_header::is_valid() const
+{
+	if (memcmp(magic, raw_file_magic, sizeof(magic)) != 0 || version != current_version || header_size != page_size
+		|| width == 0 || height == 0 || width > max_dimension || height > max_dimension
+		|| pixel_format == UNKNOWN || pixel_format > P010
+		|| row_alignment == 0 || (row_alignment & (row_alignment - 1)) || row_alignment > page_size)
+	{
+		return false;
+	}
+
+	// layout size bound: 4 bytes per pixel at most, aligned rows, chroma planes
+	if ((static_cast<uint64_t>(width) * 4 + row_alignment) * height * 2 > SIZE_MAX)
+	{
+		return false;
+	}
+
+	plane_layout planes[bitmap::max_planes];
+	size_t const size = bitmap::get_layout(image_size(width, height), static_cast<encoding>(pixel_format), planes, row_alignment);
+	return frame_size == size && frame_stride == round_up(size, page_size);
+}
+
+// paced loop of a device thread, calls fn(frame_index) at frame_rate
+// frames per second or without pauses for 0, until fn returns false
+template<typename Fn>
+static void run_paced(double frame_rate, std::atomic<bool> const& stop, Fn fn)
+{
+	typedef std::chrono::steady_clock clock;
+	clock::duration const period = frame_rate > 0?
+		std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(1.0 / frame_rate)) : clock::duration::zero();
+
+	clock::time_point due = clock::now();
+	for (uint64_t frame_index = 0; !stop; ++frame_index)
+	{
+		if (period != clock::duration::zero())
+		{
+			clock::time_point const now = clock::now();
+			if (now < due)
+			{
+				std::this_thread::sleep_until(due);
+			}
+			else if (now - due > period)
+			{
+				due = now; // a frame period behind, restart pacing from now
+			}
+			due += period;
+		}
+		if (!fn(frame_index))
+		{
+			break;
+		}
+	}
+}
+
+// replay_device
+
+class replay_device::mapping : public bitmap_storage
+{
+public:
+	mapping(uint8_t* data, size_t size)
+		: data_(data)
+		, size_(size)
+	{
+	}
+
+	~mapping()
+	{
+		munmap(data_, size_);
+	}
+
+	uint8_t* data() const { return data_; }
+
+private:
+	uint8_t* data_;
+	size_t size_;
+};
+
+replay_device::replay_device(char const* name)
+	: device(name)
+	, frame_count_(0)
+	, running_(false)
+	, stop_(false)
+	, replayed_frames_(0)
+{
+	memset(&header_, 0, sizeof(header_));
+}
+
+replay_device::~replay_device()
+{
+	close();
+}
+
+bool replay_device::open(char const* path)
+{
+	if (running_)
+	{
+		return false;
+	}
+	close();
+
+	int const fd = ::open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+	{
+		return false;
+	}
+
+	raw_file_header header;
+	struct stat st;
+	bool const valid = fstat(fd, &st) == 0
+		&& pread(fd, &header, sizeof(header), 0) == static_cast<ssize_t>(sizeof(header))
+		&& header.is_valid()
+		&& static_cast<uint64_t>(st.st_size) >= header.header_size + header.frame_stride;
+	if (!valid)
+	{
+		::close(fd);
+		return false;
+	}
+
+	// copy-on-write mapping: frames are read zero-copy, consumers may change them
+	size_t const file_size = static_cast<size_t>(st.st_size);
+	void* data = mmap(nullptr, file_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	::close(fd);
+	if (data == MAP_FAILED)
+	{
+		return false;
+	}
+	madvise(data, file_size, MADV_SEQUENTIAL);
+
+	header_ = header;
+	uint64_t const file_frames = (file_size - header.header_size) / header.frame_stride;
+	frame_count_ = (header.frame_count && header.frame_count <= file_frames? header.frame_count : file_frames);
+	mapping_ = boost::make_shared<mapping>(static_cast<uint8_t*>(data), file_size);
+	set_encoding(static_cast<encoding>(header.pixel_format));
+	return true;
+}
+
+void replay_device::close()
+{
+	stop();
+	mapping_.reset();
+	frame_count_ = 0;
+}
+
+bool replay_device::start(double frame_rate, bool loop)
+{
+	if (running_ || !mapping_)
+	{
+		return false;
+	}
+
+	stop_ = false;
+	running_ = true;
+	thread_ = boost::thread(&replay_device::run, this, frame_rate < 0? header_.frame_rate : frame_rate, loop);
+	return true;
+}
+
+void replay_device::stop()
+{
+	stop_ = true;
+	if (thread_.joinable())
+	{
+		// the device thread may wait for a free slot in the capture queue
+		while (!thread_.try_join_for(boost::chrono::milliseconds(10)))
+		{
+			capture_queue_.clear();
+		}
+	}
+	running_ = false;
+}
+
+void replay_device::run(double frame_rate, bool loop)
+{
+	boost::shared_ptr<mapping> const file = mapping_;
+	image_size const size(header_.width, header_.height);
+	encoding const pixel_format = static_cast<encoding>(header_.pixel_format);
+
+	// unpaced replay waits for consumers instead of dropping frames
+	bool const drop_frames = (frame_rate > 0);
+
+	uint64_t index = 0;
+	run_paced(frame_rate, stop_, [&](uint64_t)
+	{
+		if (index == frame_count_)
+		{
+			if (!loop)
+			{
+				return false;
+			}
+			index = 0;
+		}
+
+		uint8_t* data = file->data() + header_.header_size + index * header_.frame_stride;
+		shared_bitmap_container frame(boost::make_shared<bitmap>(size, pixel_format, data,
+			static_cast<size_t>(header_.frame_size), file, header_.row_alignment), shared_bitmap_container::INPUT);
+		frame.set_capture_time(monotonic_time());
+
+		schedule_input_frame(frame, drop_frames);
+		++replayed_frames_;
+		++index;
+		return true;
+	});
+	running_ = false;
+}
+
+void replay_device::release_input_frame(shared_bitmap_container const& frame)
+{
+	if (frame.acquire_time())
+	{
+		acquire_to_release_.record(monotonic_time() - frame.acquire_time());
+	}
+}
+
+v8::Handle<v8::Value> replay_device::get_info(v8::Isolate* isolate) const
+{
+	v8::Handle<v8::Value> info = device::get_info(isolate);
+	v8::Handle<v8::Object> o = info.As<v8::Object>();
+
+	set_option(isolate, o, "width", header_.width);
+	set_option(isolate, o, "height", header_.height);
+	set_option(isolate, o, "frame_rate", header_.frame_rate);
+	set_option(isolate, o, "frame_count", static_cast<double>(frame_count_));
+	set_option(isolate, o, "running", is_running());
+	set_option(isolate, o, "replayed_frames", static_cast<double>(replayed_frames()));
+
+	return info;
+}
+
+// record_device
+
+record_device::record_device(char const* name)
+	: device(name)
+	, fd_(-1)
+	, direct_io_(false)
+	, staging_(nullptr)
+	, write_queue_(write_queue_capacity, frame_ring::BLOCK)
+	, stop_(false)
+	, recorded_frames_(0)
+	, rejected_frames_(0)
+	, write_errors_(0)
+{
+	memset(&header_, 0, sizeof(header_));
+}
+
+record_device::~record_device()
+{
+	close();
+}
+
+bool record_device::open(char const* path, image_size const& size, encoding pixel_format,
+	double frame_rate, size_t row_alignment)
+{
+	close();
+
+	if (size.width <= 0 || size.height <= 0 || pixel_format == UNKNOWN
+		|| !row_alignment || (row_alignment & (row_alignment - 1)) || row_alignment > raw_file_header::page_size)
+	{
+		return false;
+	}
+	header_.init(size, pixel_format, row_alignment, frame_rate);
+
+	int const flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+	fd_ = ::open(path, flags | O_DIRECT, 0644);
+	direct_io_ = (fd_ >= 0 && O_DIRECT != 0);
+	if (fd_ < 0 && errno == EINVAL)
+	{
+		// file system without O_DIRECT support, e.g. tmpfs
+		fd_ = ::open(path, flags, 0644);
+	}
+	if (fd_ < 0)
+	{
+		return false;
+	}
+
+	void* staging;
+	if (posix_memalign(&staging, raw_file_header::page_size, static_cast<size_t>(header_.frame_stride)) != 0)
+	{
+		::close(fd_);
+		fd_ = -1;
+		return false;
+	}
+	staging_ = static_cast<uint8_t*>(staging);
+
+	if (!write_header())
+	{
+		close();
+		return false;
+	}
+
+	set_encoding(pixel_format);
+	recorded_frames_ = rejected_frames_ = write_errors_ = 0;
+	stop_ = false;
+	thread_ = boost::thread(&record_device::run, this);
+	return true;
+}
+
+void record_device::close()
+{
+	stop_ = true;
+	if (thread_.joinable())
+	{
+		thread_.join();
+	}
+
+	// frames queued after the writer thread has finished
+	shared_bitmap_container frame;
+	while (write_queue_.try_pop(frame))
+	{
+		++rejected_frames_;
+	}
+
+	if (fd_ >= 0)
+	{
+		header_.frame_count = recorded_frames_;
+		write_header();
+		fdatasync(fd_);
+		::close(fd_);
+		fd_ = -1;
+	}
+	free(staging_);
+	staging_ = nullptr;
+	direct_io_ = false;
+}
+
+void record_device::schedule_output_frame(shared_bitmap_container const& frame)
+{
+	// frames are written in the file layout as is
+	image_size const size(header_.width, header_.height);
+	encoding const pixel_format = static_cast<encoding>(header_.pixel_format);
+	plane_layout planes[bitmap::max_planes];
+	bitmap::get_layout(size, pixel_format, planes, header_.row_alignment);
+
+	shared_bitmap const color = frame.color();
+	bool const valid = is_open() && !stop_ && color && color->data()
+		&& color->size() == size && color->pixel_format() == pixel_format
+		&& color->stride() == planes[0].stride && color->data_size() == header_.frame_size;
+	if (!valid)
+	{
+		++rejected_frames_;
+		return;
+	}
+
+	shared_bitmap_container scheduled = frame;
+	scheduled.set_schedule_time(monotonic_time());
+
+	// the writer thread is gone after concurrent close()
+	while (!write_queue_.push_for(scheduled, 50))
+	{
+		if (stop_)
+		{
+			++rejected_frames_;
+			return;
+		}
+	}
+}
+
+void record_device::run()
+{
+	shared_bitmap_container frame;
+	while (!stop_ || !write_queue_.empty())
+	{
+		if (!write_queue_.pop_for(frame, 50))
+		{
+			continue;
+		}
+
+		uint64_t const offset = header_.header_size + recorded_frames_ * header_.frame_stride;
+		if (write_frame(*frame.color(), offset))
+		{
+			++recorded_frames_;
+			output_frame_presented(frame);
+		}
+		else
+		{
+			++write_errors_;
+		}
+		frame = shared_bitmap_container();
+	}
+}
+
+// write all iovecs at offset, continuing after partial writes
+static bool write_all(int fd, iovec* iov, int count, uint64_t offset)
+{
+	while (count > 0)
+	{
+		ssize_t written = pwritev(fd, iov, count, static_cast<off_t>(offset));
+		if (written < 0)
+		{
+			if (errno == EINTR)
+			{
+				continue;
+			}
+			return false;
+		}
+		offset += written;
+		while (count > 0 && static_cast<size_t>(written) >= iov->iov_len)
+		{
+			written -= iov->iov_len;
+			++iov;
+			--count;
+		}
+		if (count > 0)
+		{
+			iov->iov_base = static_cast<uint8_t*>(iov->iov_base) + written;
+			iov->iov_len -= written;
+		}
+	}
+	return true;
+}
+
+bool record_device::write_frame(bitmap const& frame, uint64_t offset)
+{
+	static uint8_t const zeros[raw_file_header::page_size] = {};
+	size_t const page_size = raw_file_header::page_size;
+	size_t const frame_size = static_cast<size_t>(header_.frame_size);
+	size_t const frame_stride = static_cast<size_t>(header_.frame_stride);
+	uint8_t* data = const_cast<uint8_t*>(frame.data());
+
+	iovec iov[2];
+	int count = 0;
+	if (direct_io_)
+	{
+		// O_DIRECT needs page aligned buffers and sizes: whole pages of
+		// page aligned pixel data are written in place, the rest is copied
+		size_t const in_place = (reinterpret_cast<uintptr_t>(data) % page_size == 0? frame_size / page_size * page_size : 0);
+		if (in_place)
+		{
+			iov[count].iov_base = data;
+			iov[count].iov_len = in_place;
+			++count;
+		}
+		size_t const rest = frame_size - in_place;
+		if (rest)
+		{
+			size_t const padded = frame_stride - in_place;
+			memcpy(staging_, data + in_place, rest);
+			memset(staging_ + rest, 0, padded - rest);
+			iov[count].iov_base = staging_;
+			iov[count].iov_len = padded;
+			++count;
+		}
+	}
+	else
+	{
+		iov[count].iov_base = data;
+		iov[count].iov_len = frame_size;
+		++count;
+		if (frame_stride > frame_size)
+		{
+			iov[count].iov_base = const_cast<uint8_t*>(zeros);
+			iov[count].iov_len = frame_stride - frame_size;
+			++count;
+		}
+	}
+	return write_all(fd_, iov, count, offset);
+}
+
+bool record_device::write_header()
+{
+	// staging buffer is page aligned for O_DIRECT
+	memset(staging_, 0, raw_file_header::page_size);
+	memcpy(staging_, &header_, sizeof(header_));
+	return pwrite(fd_, staging_, raw_file_header::page_size, 0) == static_cast<ssize_t>(raw_file_header::page_size);
+}
+
+v8::Handle<v8::Value> record_device::get_info(v8::Isolate* isolate) const
+{
+	v8::Handle<v8::Value> info = device::get_info(isolate);
+	v8::Handle<v8::Object> o = info.As<v8::Object>();
+
+	set_option(isolate, o, "width", header_.width);
+	set_option(isolate, o, "height", header_.height);
+	set_option(isolate, o, "direct_io", is_direct_io());
+	set_option(isolate, o, "pending_frames", static_cast<double>(write_queue_.size()));
+	set_option(isolate, o, "recorded_frames", static_cast<double>(recorded_frames()));
+	set_option(isolate, o, "rejected_frames", static_cast<double>(rejected_frames()));
+	set_option(isolate, o, "write_errors", static_cast<double>(write_errors()));
+
+	return info;
+}
+
+}} // aspect::image
@@ -8,21 +8,25 @@ namespace aspect { namespace image {
 template<uint32_t N>
 float rescaler::get(int x,int y)
 {
-	return data_orig_[y * src_stride_ + x * 4 + N];
+	return N < (uint32_t)channels_? data_orig_[y * src_stride_ + x * channels_ + N] : 0.0f;
 }
 
 template<uint32_t N>
 void rescaler::set(int x,int y,float val)
 {
-	data_result_[y * dst_stride_ + x * 4 + N] = (uint8_t)val;
+	if (N < (uint32_t)channels_) data_result_[y * dst_stride_ + x * channels_ + N] = (uint8_t)val;
 }
 
 void rescaler::set(int x, int y, float v1, float v2, float v3, float v4)
 {
-	data_result_[y * dst_stride_ + x * 4 + 0] = (uint8_t)v1;
-	data_result_[y * dst_stride_ + x * 4 + 1] = (uint8_t)v2;
-	data_result_[y * dst_stride_ + x * 4 + 2] = (uint8_t)v3;
-	data_result_[y * dst_stride_ + x * 4 + 3] = (uint8_t)v4;
+	uint8_t* const p = &data_result_[y * dst_stride_ + x * channels_];
+	switch (channels_)
+	{
+	case 4: p[3] = (uint8_t)v4; // fall through
+	case 3: p[2] = (uint8_t)v3; // fall through
+	case 2: p[1] = (uint8_t)v2; // fall through
+	case 1: p[0] = (uint8_t)v1;
+	}
 }
 
 
@@ -288,8 +292,8 @@ void rescaler::alloc(int dst_width, int dst_height, bool reassign)
 		owns_data_orig_ = true;
 	}
 
-	data_result_ = (uint8_t*)malloc(dst_width*dst_height*4*sizeof(uint8_t));
-	dst_stride_ = dst_width*4;
+	data_result_ = (uint8_t*)malloc(dst_width*dst_height*channels_*sizeof(uint8_t));
+	dst_stride_ = dst_width*channels_;
 	dst_width_ = dst_width;
 	dst_height_ = dst_height;
 }
@@ -314,7 +318,8 @@ void rescaler::dealloc()
 rescaler::rescaler()
 	: owns_data_orig_(false),
 	data_orig_(NULL),
-	data_result_(NULL)
+	data_result_(NULL),
+	channels_(4)
 {
 }
 
@@ -326,15 +331,24 @@ rescaler::~rescaler()
 void rescaler::rescale(uint8_t* pixels, image_size const& src_size, int mode, image_size const& dst_size,
 		float xpos,float ypos,float xscale,float yscale)
 {
+	rescale(pixels, src_size, src_size.width * 4, 4, mode, dst_size, xpos, ypos, xscale, yscale);
+}
+
+void rescaler::rescale(uint8_t* pixels, image_size const& src_size, int stride, int channels, int mode, image_size const& dst_size,
+		float xpos,float ypos,float xscale,float yscale)
+{
+	_aspect_assert(channels >= 1 && channels <= 4);
+
 	dealloc();
 
 	owns_data_orig_ = false;
 	data_orig_ = pixels;
 	data_result_ = NULL;
+	channels_ = channels;
 	src_width_ = src_size.width;
 	src_height_ = src_size.height;
-	src_stride_ = src_size.width * 4;
-	dst_stride_ = dst_size.width * 4;
+	src_stride_ = stride;
+	dst_stride_ = dst_size.width * channels;
 	dst_width_ = -1;
 	dst_height_ = -1;
 
@@ -353,4 +367,38 @@ void rescaler::rescale(uint8_t* pixels, image_size const& src_size, int mode, im
 	}
 }
 
+bool rescale(bitmap const& src, bitmap& dst, image_size const& dst_size, int mode)
+{
+	switch (src.pixel_format())
+	{
+	case A8: case RGB8: case RGBA8: case ARGB8: case BGRA8: case I420: case NV12:
+		break;
+	default:
+		return false;
+	}
+
+	dst.resize(dst_size, src.pixel_format());
+
+	// planar formats are rescaled plane by plane, NV12 chroma as 2-channel pixels
+	size_t const planes = src.plane_count();
+	for (size_t i = 0; i < planes; ++i)
+	{
+		plane_layout const& src_plane = src.plane(i);
+		plane_layout const& dst_plane = dst.plane(i);
+		int const channels = static_cast<int>(i == 0? src.bytes_per_pixel() : src.pixel_format() == NV12? 2 : 1);
+
+		rescaler r;
+		r.rescale(const_cast<uint8_t*>(src.plane_data(i)), src_plane.size, static_cast<int>(src_plane.stride), channels,
+			mode, dst_plane.size);
+
+		uint8_t* out = dst.plane_data(i);
+		size_t const row = static_cast<size_t>(r.stride());
+		for (int y = 0; y < dst_plane.size.height; ++y)
+		{
+			memcpy(out + y * dst_plane.stride, r.pixels() + y * row, row);
+		}
+	}
+	return true;
+}
+
 }} // aspect::image
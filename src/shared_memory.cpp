@@ -0,0 +1,645 @@
+#include "image/shared_memory.hpp"
+
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/make_shared.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <map>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+namespace aspect { namespace image {
+
+static int create_shared_memory_fd()
+{
+#ifdef SYS_memfd_create
+	int fd = static_cast<int>(syscall(SYS_memfd_create, "aspect_image_bitmap", MFD_CLOEXEC));
+	if (fd >= 0)
+	{
+		return fd;
+	}
+#endif
+	// no memfd, use a POSIX shared memory object unlinked right after creation
+	static std::atomic<unsigned> counter(0);
+	for (int attempt = 0; attempt < 16; ++attempt)
+	{
+		char name[64];
+		snprintf(name, sizeof(name), "/aspect_image_%d_%u", static_cast<int>(getpid()), counter++);
+		int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+		if (fd >= 0)
+		{
+			shm_unlink(name);
+			fcntl(fd, F_SETFD, FD_CLOEXEC);
+			return fd;
+		}
+		if (errno != EEXIST)
+		{
+			break;
+		}
+	}
+	return -1;
+}
+
+shared_memory::shared_memory(int fd, uint8_t* mapping, size_t mapping_size, size_t offset, size_t size)
+	: fd_(fd)
+	, mapping_(mapping)
+	, mapping_size_(mapping_size)
+	, offset_(offset)
+	, size_(size)
+	, data_(mapping + mapping_size - size)
+{
+}
+
+shared_memory::~shared_memory()
+{
+	munmap(mapping_, mapping_size_);
+	close(fd_);
+}
+
+boost::shared_ptr<shared_memory> shared_memory::create(size_t size)
+{
+	int const fd = create_shared_memory_fd();
+	if (fd < 0)
+	{
+		return boost::shared_ptr<shared_memory>();
+	}
+	if (ftruncate(fd, size) != 0)
+	{
+		close(fd);
+		return boost::shared_ptr<shared_memory>();
+	}
+	return map(fd, size, 0);
+}
+
+boost::shared_ptr<shared_memory> shared_memory::map(int fd, size_t size, size_t offset)
+{
+	// a file shorter than the mapping maps fine, but raises SIGBUS on access
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size < 0 || offset > static_cast<uint64_t>(st.st_size)
+		|| size > static_cast<uint64_t>(st.st_size) - offset)
+	{
+		close(fd);
+		return boost::shared_ptr<shared_memory>();
+	}
+
+	// mapping offset must be page aligned
+	size_t const page_size = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+	size_t const map_offset = offset & ~(page_size - 1);
+	size_t const mapping_size = size + (offset - map_offset);
+
+	void* mapping = mmap(nullptr, mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, map_offset);
+	if (mapping == MAP_FAILED)
+	{
+		close(fd);
+		return boost::shared_ptr<shared_memory>();
+	}
+	return boost::shared_ptr<shared_memory>(new shared_memory(fd, static_cast<uint8_t*>(mapping), mapping_size, offset, size));
+}
+
+shared_bitmap create_shared_bitmap(image_size const& size, encoding pixel_format, size_t row_alignment)
+{
+	plane_layout planes[bitmap::max_planes];
+	size_t const data_size = bitmap::get_layout(size, pixel_format, planes, row_alignment);
+	boost::shared_ptr<shared_memory> memory = shared_memory::create(data_size);
+	if (!memory)
+	{
+		return shared_bitmap();
+	}
+	return boost::make_shared<bitmap>(size, pixel_format, memory->data(), memory->size(), memory, row_alignment);
+}
+
+bool get_shared_bitmap_descriptor(bitmap const& bmp, shared_bitmap_descriptor& descriptor)
+{
+	boost::shared_ptr<shared_memory> memory = boost::dynamic_pointer_cast<shared_memory>(bmp.storage());
+	if (!memory || bmp.data() != memory->data())
+	{
+		// no shared memory, or the bitmap was resized out of it
+		return false;
+	}
+
+	descriptor.fd = memory->fd();
+	descriptor.offset = memory->offset();
+	descriptor.size = memory->size();
+	descriptor.width = bmp.size().width;
+	descriptor.height = bmp.size().height;
+	descriptor.stride = static_cast<uint32_t>(bmp.stride());
+	descriptor.row_alignment = static_cast<uint32_t>(bmp.row_alignment());
+	descriptor.pixel_format = bmp.pixel_format();
+	return true;
+}
+
+bool shared_bitmap_descriptor::is_valid() const
+{
+	if (width == 0 || height == 0 || width > max_dimension || height > max_dimension
+		|| pixel_format <= UNKNOWN || pixel_format > P010
+		|| row_alignment == 0 || (row_alignment & (row_alignment - 1)) || row_alignment > max_row_alignment)
+	{
+		return false;
+	}
+
+	// layout size bound: 4 bytes per pixel at most, aligned rows, chroma planes
+	if ((static_cast<uint64_t>(width) * 4 + row_alignment) * height * 2 > SIZE_MAX)
+	{
+		return false;
+	}
+
+	// planes follow each other as in bitmap::get_layout()
+	plane_layout planes[bitmap::max_planes];
+	size_t const data_size = bitmap::get_layout(image_size(width, height), pixel_format, planes, row_alignment);
+	return stride == planes[0].stride && data_size <= size;
+}
+
+static bitmap* new_mapped_bitmap(shared_bitmap_descriptor const& descriptor)
+{
+	// the descriptor comes from a peer process
+	if (!descriptor.is_valid())
+	{
+		close(descriptor.fd);
+		return nullptr;
+	}
+	image_size const size(descriptor.width, descriptor.height);
+	size_t const row_alignment = descriptor.row_alignment;
+
+	boost::shared_ptr<shared_memory> memory = shared_memory::map(descriptor.fd,
+		static_cast<size_t>(descriptor.size), static_cast<size_t>(descriptor.offset));
+	if (!memory || reinterpret_cast<uintptr_t>(memory->data()) % row_alignment)
+	{
+		return nullptr;
+	}
+	return new bitmap(size, descriptor.pixel_format, memory->data(), memory->size(), memory, row_alignment);
+}
+
+shared_bitmap map_shared_bitmap(shared_bitmap_descriptor const& descriptor)
+{
+	return shared_bitmap(new_mapped_bitmap(descriptor));
+}
+
+// shared_bitmap_channel
+
+class shared_bitmap_channel::impl : public boost::enable_shared_from_this<impl>
+{
+public:
+	explicit impl(int socket)
+		: socket_(socket)
+		, connected_(socket >= 0)
+		, next_id_(0)
+		, released_(0)
+	{
+	}
+
+	~impl()
+	{
+		if (socket_ >= 0)
+		{
+			close(socket_);
+		}
+	}
+
+	int socket() const { return socket_; }
+
+	bool is_connected() const { return connected_; }
+
+	bool send(shared_bitmap const& bmp)
+	{
+		shared_bitmap_descriptor descriptor;
+		if (!bmp || !connected_ || !get_shared_bitmap_descriptor(*bmp, descriptor))
+		{
+			return false;
+		}
+
+		message msg = message();
+		msg.type = message::FRAME;
+		msg.pixel_format = descriptor.pixel_format;
+		msg.offset = descriptor.offset;
+		msg.size = descriptor.size;
+		msg.width = descriptor.width;
+		msg.height = descriptor.height;
+		msg.stride = descriptor.stride;
+		msg.row_alignment = descriptor.row_alignment;
+
+		// reference the bitmap before sending, the peer may release it immediately
+		{
+			boost::mutex::scoped_lock lock(in_flight_mutex_);
+			msg.id = next_id_++;
+			in_flight_[msg.id] = bmp;
+		}
+
+		bool sent;
+		{
+			boost::mutex::scoped_lock lock(send_mutex_);
+			sent = (send_message(msg, descriptor.fd, true) == SENT);
+		}
+		flush_releases();
+		if (!sent)
+		{
+			shared_bitmap unsent;
+			boost::mutex::scoped_lock lock(in_flight_mutex_);
+			std::map<uint64_t, shared_bitmap>::iterator it = in_flight_.find(msg.id);
+			if (it != in_flight_.end())
+			{
+				unsent.swap(it->second);
+				in_flight_.erase(it);
+			}
+			return false;
+		}
+		return true;
+	}
+
+	bool receive(shared_bitmap& bmp, int timeout_ms)
+	{
+		boost::mutex::scoped_lock lock(receive_mutex_);
+
+		std::chrono::steady_clock::time_point const deadline = std::chrono::steady_clock::now()
+			+ std::chrono::milliseconds(timeout_ms < 0? 0 : timeout_ms);
+		while (received_.empty())
+		{
+			int wait_ms = -1;
+			if (timeout_ms >= 0)
+			{
+				wait_ms = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(
+					deadline - std::chrono::steady_clock::now()).count());
+				if (wait_ms < 0)
+				{
+					wait_ms = 0;
+				}
+			}
+			int const result = read_message(wait_ms);
+			if (result < 0 || (result == 0 && wait_ms == 0))
+			{
+				return false;
+			}
+		}
+
+		bmp = received_.front();
+		received_.pop_front();
+		return true;
+	}
+
+	size_t process_releases()
+	{
+		boost::mutex::scoped_lock lock(receive_mutex_);
+
+		size_t const released = released_;
+		while (read_message(0) > 0)
+		{
+		}
+		return released_ - released;
+	}
+
+	size_t in_flight() const
+	{
+		boost::mutex::scoped_lock lock(in_flight_mutex_);
+		return in_flight_.size();
+	}
+
+private:
+	struct message
+	{
+		enum type_t { FRAME = 1, RELEASE = 2 };
+
+		uint32_t type;
+		uint32_t pixel_format;
+		uint64_t id;
+		uint64_t offset;
+		uint64_t size;
+		uint32_t width;
+		uint32_t height;
+		uint32_t stride;
+		uint32_t row_alignment;
+	};
+
+	enum send_result { SENT, WOULD_BLOCK, FAILED };
+
+	// Send message with optional descriptor, send_mutex_ must be locked
+	send_result send_message(message const& msg, int fd, bool wait)
+	{
+		iovec iov;
+		iov.iov_base = const_cast<message*>(&msg);
+		iov.iov_len = sizeof(msg);
+
+		msghdr hdr = msghdr();
+		hdr.msg_iov = &iov;
+		hdr.msg_iovlen = 1;
+
+		char control[CMSG_SPACE(sizeof(int))];
+		if (fd >= 0)
+		{
+			memset(control, 0, sizeof(control));
+			hdr.msg_control = control;
+			hdr.msg_controllen = sizeof(control);
+
+			cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
+			cmsg->cmsg_level = SOL_SOCKET;
+			cmsg->cmsg_type = SCM_RIGHTS;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+			memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+		}
+
+		ssize_t result;
+		do
+		{
+			result = sendmsg(socket_, &hdr, MSG_NOSIGNAL | (wait? 0 : MSG_DONTWAIT));
+		} while (result < 0 && errno == EINTR);
+
+		if (result == static_cast<ssize_t>(sizeof(msg)))
+		{
+			return SENT;
+		}
+		if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+		{
+			return WOULD_BLOCK;
+		}
+		if (result < 0 && (errno == EPIPE || errno == ECONNRESET))
+		{
+			connected_ = false;
+		}
+		return FAILED;
+	}
+
+	// Queue release of a received bitmap, called from bitmap deleters on any
+	// thread, so it never blocks: releases the socket can't take now are
+	// retried on the next channel call
+	void send_release(uint64_t id)
+	{
+		if (connected_)
+		{
+			{
+				boost::mutex::scoped_lock lock(release_mutex_);
+				pending_releases_.push_back(id);
+			}
+			flush_releases();
+		}
+	}
+
+	void flush_releases()
+	{
+		boost::mutex::scoped_lock send_lock(send_mutex_, boost::try_to_lock);
+		if (!send_lock.owns_lock())
+		{
+			return; // retried by the send_mutex_ owner or the next call
+		}
+
+		boost::mutex::scoped_lock lock(release_mutex_);
+		while (!pending_releases_.empty() && connected_)
+		{
+			message msg = message();
+			msg.type = message::RELEASE;
+			msg.id = pending_releases_.front();
+			send_result const result = send_message(msg, -1, false);
+			if (result == WOULD_BLOCK)
+			{
+				return;
+			}
+			pending_releases_.pop_front();
+		}
+		if (!connected_)
+		{
+			pending_releases_.clear();
+		}
+	}
+
+	// Read and handle one message, returns 1 on success,
+	// 0 on timeout, -1 on disconnection or error
+	int read_message(int timeout_ms)
+	{
+		flush_releases();
+		if (!connected_)
+		{
+			return -1;
+		}
+
+		pollfd pfd;
+		pfd.fd = socket_;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		int const ready = poll(&pfd, 1, timeout_ms);
+		if (ready == 0 || (ready < 0 && errno == EINTR))
+		{
+			return 0;
+		}
+
+		message msg;
+		iovec iov;
+		iov.iov_base = &msg;
+		iov.iov_len = sizeof(msg);
+
+		char control[CMSG_SPACE(sizeof(int))];
+		msghdr hdr = msghdr();
+		hdr.msg_iov = &iov;
+		hdr.msg_iovlen = 1;
+		hdr.msg_control = control;
+		hdr.msg_controllen = sizeof(control);
+
+		ssize_t const result = ready > 0? recvmsg(socket_, &hdr, MSG_DONTWAIT) : -1;
+		if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		{
+			return 0;
+		}
+
+		int fd = -1;
+		for (cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr); result > 0 && cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg))
+		{
+			if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+			{
+				memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+			}
+		}
+
+		if (result != static_cast<ssize_t>(sizeof(msg)))
+		{
+			if (fd >= 0)
+			{
+				close(fd);
+			}
+			disconnect();
+			return -1;
+		}
+
+		switch (msg.type)
+		{
+		case message::FRAME:
+			if (fd >= 0)
+			{
+				shared_bitmap_descriptor descriptor;
+				descriptor.fd = fd;
+				descriptor.offset = msg.offset;
+				descriptor.size = msg.size;
+				descriptor.width = msg.width;
+				descriptor.height = msg.height;
+				descriptor.stride = msg.stride;
+				descriptor.row_alignment = msg.row_alignment;
+				descriptor.pixel_format = static_cast<encoding>(msg.pixel_format);
+
+				if (bitmap* bmp = new_mapped_bitmap(descriptor))
+				{
+					boost::weak_ptr<impl> channel = shared_from_this();
+					uint64_t const id = msg.id;
+					received_.push_back(shared_bitmap(bmp, [channel, id](bitmap* bmp)
+						{
+							delete bmp;
+							if (boost::shared_ptr<impl> self = channel.lock())
+							{
+								self->send_release(id);
+							}
+						}));
+				}
+				else
+				{
+					// can't map, let the sender recycle it
+					send_release(msg.id);
+				}
+			}
+			break;
+		case message::RELEASE:
+			{
+				shared_bitmap released;
+				boost::mutex::scoped_lock lock(in_flight_mutex_);
+				std::map<uint64_t, shared_bitmap>::iterator it = in_flight_.find(msg.id);
+				if (it != in_flight_.end())
+				{
+					released.swap(it->second);
+					in_flight_.erase(it);
+					++released_;
+				}
+			}
+			break;
+		default:
+			if (fd >= 0)
+			{
+				close(fd);
+			}
+			break;
+		}
+		return 1;
+	}
+
+	void disconnect()
+	{
+		connected_ = false;
+
+		// the peer has gone, drop references to the sent bitmaps
+		std::map<uint64_t, shared_bitmap> in_flight;
+		{
+			boost::mutex::scoped_lock lock(in_flight_mutex_);
+			in_flight.swap(in_flight_);
+		}
+		released_ += in_flight.size();
+	}
+
+	int socket_;
+	std::atomic<bool> connected_;
+
+	boost::mutex send_mutex_;
+	boost::mutex release_mutex_;
+	boost::mutex receive_mutex_;
+	mutable boost::mutex in_flight_mutex_;
+
+	std::map<uint64_t, shared_bitmap> in_flight_;
+	uint64_t next_id_;
+	size_t released_;
+	std::deque<shared_bitmap> received_;
+	std::deque<uint64_t> pending_releases_; // not sent yet, guarded by release_mutex_
+};
+
+shared_bitmap_channel::shared_bitmap_channel(int socket)
+	: impl_(boost::make_shared<impl>(socket))
+{
+}
+
+shared_bitmap_channel::~shared_bitmap_channel()
+{
+}
+
+bool shared_bitmap_channel::create_pair(boost::shared_ptr<shared_bitmap_channel>& first,
+	boost::shared_ptr<shared_bitmap_channel>& second)
+{
+#if OS(LINUX)
+	int const type = SOCK_SEQPACKET;
+#else
+	int const type = SOCK_DGRAM;
+#endif
+	int sockets[2];
+	if (socketpair(AF_UNIX, type, 0, sockets) != 0)
+	{
+		return false;
+	}
+	first = boost::make_shared<shared_bitmap_channel>(sockets[0]);
+	second = boost::make_shared<shared_bitmap_channel>(sockets[1]);
+	return true;
+}
+
+boost::shared_ptr<shared_bitmap_channel> shared_bitmap_channel::connect(char const* path)
+{
+	sockaddr_un addr = sockaddr_un();
+	if (!path || strlen(path) >= sizeof(addr.sun_path))
+	{
+		return boost::shared_ptr<shared_bitmap_channel>();
+	}
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	int const sock = ::socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (sock < 0)
+	{
+		return boost::shared_ptr<shared_bitmap_channel>();
+	}
+	if (::connect(sock, reinterpret_cast<sockaddr const*>(&addr), sizeof(addr)) != 0)
+	{
+		close(sock);
+		return boost::shared_ptr<shared_bitmap_channel>();
+	}
+	return boost::make_shared<shared_bitmap_channel>(sock);
+}
+
+int shared_bitmap_channel::socket() const
+{
+	return impl_->socket();
+}
+
+bool shared_bitmap_channel::send(shared_bitmap const& bmp)
+{
+	return impl_->send(bmp);
+}
+
+bool shared_bitmap_channel::receive(shared_bitmap& bmp, int timeout_ms)
+{
+	return impl_->receive(bmp, timeout_ms);
+}
+
+size_t shared_bitmap_channel::process_releases()
+{
+	return impl_->process_releases();
+}
+
+size_t shared_bitmap_channel::in_flight() const
+{
+	return impl_->in_flight();
+}
+
+bool shared_bitmap_channel::is_connected() const
+{
+	return impl_->is_connected();
+}
+
+}} // aspect::image
@@ -0,0 +1,252 @@
+#include "image/test_source.hpp"
+#include "image/convert.hpp"
+#include "image/rescaler.hpp"
+
+#include <boost/make_shared.hpp>
+#include <boost/thread/locks.hpp>
+
+#include <chrono>
+#include <cstring>
+#include <thread>
+
+namespace aspect { namespace image {
+
+static char const* pattern_name(test_source_device::pattern p)
+{
+	switch (p)
+	{
+	case test_source_device::CHECKER2: return "checker2";
+	case test_source_device::CHECKER3: return "checker3";
+	case test_source_device::GRADIENT: return "gradient";
+	case test_source_device::NOISE:    return "noise";
+	case test_source_device::CLIP:     return "clip";
+	}
+	return "";
+}
+
+// conversion on the device thread, as capture hardware drivers do
+static convert_options device_convert_options()
+{
+	convert_options options;
+	options.max_threads = 1;
+	return options;
+}
+
+test_source_device::test_source_device(char const* name)
+	: device(name)
+	, frame_rate_(0)
+	, pattern_(CHECKER3)
+	, drop_frames_(true)
+	, running_(false)
+	, stop_(false)
+	, generated_frames_(0)
+	, late_frames_(0)
+{
+}
+
+test_source_device::~test_source_device()
+{
+	stop();
+}
+
+void test_source_device::set_clip(std::vector<shared_bitmap> const& frames)
+{
+	boost::lock_guard<boost::mutex> lock(clip_mutex_);
+	clip_ = frames;
+}
+
+bool test_source_device::start(image_size const& size, encoding pixel_format, double frame_rate, pattern p)
+{
+	if (running_ || (pixel_format != BGRA8 && !can_convert(BGRA8, pixel_format)))
+	{
+		return false;
+	}
+
+	// prepare clip frames to copy them on the device thread
+	clip_frames_.clear();
+	{
+		boost::lock_guard<boost::mutex> lock(clip_mutex_);
+		for (size_t i = 0; i < clip_.size(); ++i)
+		{
+			shared_bitmap src = clip_[i];
+			if (!src || !can_convert(src->pixel_format(), pixel_format))
+			{
+				continue;
+			}
+			if (src->size() != size)
+			{
+				shared_bitmap scaled = boost::make_shared<bitmap>(ALLOC_UNINITIALIZED);
+				if (!rescale(*src, *scaled, size))
+				{
+					continue;
+				}
+				src = scaled;
+			}
+			shared_bitmap frame = boost::make_shared<bitmap>(size, pixel_format, ALLOC_UNINITIALIZED);
+			if (convert(*src, *frame, device_convert_options()))
+			{
+				clip_frames_.push_back(frame);
+			}
+		}
+	}
+	if (p == CLIP && clip_frames_.empty())
+	{
+		return false;
+	}
+
+	size_ = size;
+	frame_rate_ = frame_rate;
+	pattern_ = p;
+	set_encoding(pixel_format);
+
+	stop_ = false;
+	running_ = true;
+	thread_ = boost::thread(&test_source_device::run, this);
+	return true;
+}
+
+void test_source_device::stop()
+{
+	stop_ = true;
+	if (thread_.joinable())
+	{
+		// the device thread may wait for a free slot in the capture queue
+		while (!thread_.try_join_for(boost::chrono::milliseconds(10)))
+		{
+			capture_queue_.clear();
+		}
+	}
+	running_ = false;
+}
+
+void test_source_device::run()
+{
+	typedef std::chrono::steady_clock clock;
+	clock::duration const period = frame_rate_ > 0?
+		std::chrono::duration_cast<clock::duration>(std::chrono::duration<double>(1.0 / frame_rate_)) : clock::duration::zero();
+
+	bitmap pattern_bitmap(ALLOC_UNINITIALIZED);
+	clock::time_point due = clock::now();
+	for (uint64_t frame_index = 0; !stop_; ++frame_index)
+	{
+		if (period != clock::duration::zero())
+		{
+			clock::time_point const now = clock::now();
+			if (now < due)
+			{
+				std::this_thread::sleep_until(due);
+			}
+			else if (now - due > period)
+			{
+				// a frame period behind, restart pacing from now
+				++late_frames_;
+				due = now;
+			}
+			due += period;
+		}
+
+		shared_bitmap_container frame = next_frame();
+		generate(*frame.color(), pattern_bitmap, frame_index);
+		frame.set_capture_time(monotonic_time());
+
+		schedule_input_frame(frame, drop_frames_);
+		++generated_frames_;
+	}
+}
+
+shared_bitmap_container test_source_device::next_frame()
+{
+	shared_bitmap_container frame;
+	while (available_queue_.try_pop(frame))
+	{
+		shared_bitmap const& color = frame.color();
+		if (color && color->size() == size_ && color->pixel_format() == get_encoding())
+		{
+			return frame;
+		}
+	}
+	return shared_bitmap_container(boost::make_shared<bitmap>(size_, get_encoding(), ALLOC_UNINITIALIZED),
+		shared_bitmap_container::INPUT);
+}
+
+void test_source_device::generate(bitmap& frame, bitmap& pattern_bitmap, uint64_t frame_index)
+{
+	pattern const p = pattern_;
+	if (p == CLIP && !clip_frames_.empty())
+	{
+		bitmap const& clip_frame = *clip_frames_[frame_index % clip_frames_.size()];
+		memcpy(frame.data(), clip_frame.data(), std::min(frame.data_size(), clip_frame.data_size()));
+		return;
+	}
+
+	bitmap& target = (frame.pixel_format() == BGRA8? frame : pattern_bitmap);
+	target.resize(size_, BGRA8);
+
+	int const width = size_.width;
+	int const height = size_.height;
+	switch (p)
+	{
+	case CHECKER2:
+		target.checker2();
+		break;
+	case CHECKER3:
+	case CLIP:
+		target.checker3();
+		break;
+	case GRADIENT:
+		{
+			int const shift = static_cast<int>(frame_index * 4 % width);
+			for (int y = 0; y < height; ++y)
+			{
+				uint32_t* row = reinterpret_cast<uint32_t*>(target.data() + y * target.stride());
+				uint32_t const green = static_cast<uint32_t>(y * 255 / height) << 8;
+				for (int x = 0; x < width; ++x)
+				{
+					uint32_t const v = static_cast<uint32_t>((x + shift) % width * 255 / width);
+					row[x] = v | green | (255 - v) << 16; // opaque, alpha is stored inverted
+				}
+			}
+		}
+		break;
+	case NOISE:
+		{
+			// xorshift64, seeded by frame index for reproducible frames
+			uint64_t state = 0x9E3779B97F4A7C15ull * (frame_index + 1);
+			for (int y = 0; y < height; ++y)
+			{
+				uint32_t* row = reinterpret_cast<uint32_t*>(target.data() + y * target.stride());
+				for (int x = 0; x < width; ++x)
+				{
+					state ^= state << 13;
+					state ^= state >> 7;
+					state ^= state << 17;
+					row[x] = static_cast<uint32_t>(state) & 0x00FFFFFF;
+				}
+			}
+		}
+		break;
+	}
+
+	if (&target != &frame)
+	{
+		convert(target, frame, device_convert_options());
+	}
+}
+
+v8::Handle<v8::Value> test_source_device::get_info(v8::Isolate* isolate) const
+{
+	v8::Handle<v8::Value> info = device::get_info(isolate);
+	v8::Handle<v8::Object> o = info.As<v8::Object>();
+
+	set_option(isolate, o, "pattern", pattern_name(pattern_));
+	set_option(isolate, o, "width", size_.width);
+	set_option(isolate, o, "height", size_.height);
+	set_option(isolate, o, "frame_rate", frame_rate_);
+	set_option(isolate, o, "running", is_running());
+	set_option(isolate, o, "generated_frames", static_cast<double>(generated_frames()));
+	set_option(isolate, o, "late_frames", static_cast<double>(late_frames()));
+
+	return info;
+}
+
+}} // aspect::image